@@ -0,0 +1,142 @@
+/* Synthetic corpus generator for `make bench`, built with the host compiler.
+ *
+ * Usage: gen_corpus <kind> <bytes>
+ *
+ * Writes roughly <bytes> of C source of the given kind to stdout, every kind
+ * stresses one path of the lexer:
+ *
+ *   ident    identifiers and keywords
+ *   punct    operators and punctuators
+ *   comment  block and line comments around sparse code
+ *   string   string and character literals
+ *   macro    long chains of object-like macros
+ *   cond     deeply nested conditionals with dead groups
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static long written;
+
+static void out(const char *str)
+{
+    fputs(str, stdout);
+    written += strlen(str);
+}
+
+static void outf(const char *fmt, long value)
+{
+    char buf[128];
+
+    snprintf(buf, sizeof(buf), fmt, value);
+    out(buf);
+}
+
+static void gen_ident(long limit)
+{
+    static const char *words[] = {"int",   "while", "return", "struct",
+                                  "alpha", "beta",  "gamma",  "delta_value",
+                                  "x",     "for",   "sizeof", "node_next"};
+
+    for (long i = 0; written < limit; i++) {
+        out(words[i % 12]);
+        outf("%ld", i % 97);
+        out(i % 9 == 8 ? "\n" : " ");
+    }
+}
+
+static void gen_punct(long limit)
+{
+    static const char *ops[] = {"+",  "-",  "*",  "/",  "%",  "<<", ">>",
+                                "<=", ">=", "==", "!=", "&&", "||", "->",
+                                "++", "--", "+=", "-=", "&=", "|=", "(",
+                                ")",  "[",  "]",  "{",  "}",  ";",  ",",
+                                "?",  ":",  "!",  "~",  "^",  "...", "."};
+
+    for (long i = 0; written < limit; i++) {
+        out(ops[i % 35]);
+        out(i % 16 == 15 ? "\n" : " ");
+    }
+}
+
+static void gen_comment(long limit)
+{
+    for (long i = 0; written < limit; i++) {
+        out("/* Lorem ipsum dolor sit amet, consectetur adipiscing elit,\n"
+            " * sed do eiusmod tempor incididunt ut labore. */\n");
+        outf("value%ld = 1; // trailing remark about the value\n", i % 50);
+    }
+}
+
+static void gen_string(long limit)
+{
+    for (long i = 0; written < limit; i++) {
+        outf("char *message%ld = \"The quick brown fox jumps over\";\n",
+             i % 50);
+        out("char c = 'q';\n");
+    }
+}
+
+static void gen_macro(long limit)
+{
+    /* Depth stays below MAX_REGIONAL_LEXERS_SIZE */
+    out("#define M0 base\n");
+    for (long i = 1; i < 24; i++) {
+        outf("#define M%ld ", i);
+        outf("M%ld + 1\n", i - 1);
+    }
+
+    for (long i = 0; written < limit; i++)
+        outf("total = M%ld;\n", 8 + i % 16);
+}
+
+static void gen_cond(long limit)
+{
+    out("#define LEVEL 7\n#define FEATURE_A 1\n");
+
+    for (long i = 0; written < limit; i++) {
+        for (long depth = 0; depth < 12; depth++) {
+            outf("#if LEVEL > %ld\n", depth % 10);
+            if (depth % 3 == 0)
+                out("#ifdef FEATURE_A\nlive = 1;\n#else\ndead = 0;\n#endif\n");
+        }
+        out("inner = 2;\n");
+        for (long depth = 0; depth < 12; depth++) {
+            out("#else\nnever (reached) [at] {all};\n");
+            outf("/* %ld */\n#endif\n", depth);
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    long limit;
+
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <kind> <bytes>\n", argv[0]);
+        return 1;
+    }
+
+    limit = atol(argv[2]);
+
+    if (!strcmp(argv[1], "ident"))
+        gen_ident(limit);
+    else if (!strcmp(argv[1], "punct"))
+        gen_punct(limit);
+    else if (!strcmp(argv[1], "comment"))
+        gen_comment(limit);
+    else if (!strcmp(argv[1], "string"))
+        gen_string(limit);
+    else if (!strcmp(argv[1], "macro"))
+        gen_macro(limit);
+    else if (!strcmp(argv[1], "cond"))
+        gen_cond(limit);
+    else {
+        fprintf(stderr, "Unknown corpus kind: %s\n", argv[1]);
+        return 1;
+    }
+
+    out("\n");
+    return 0;
+}
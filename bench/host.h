@@ -0,0 +1,116 @@
+/* Lets Shepherd build with a host compiler such as gcc or clang, by providing
+ * the few shecc libc internals it calls on top of the host libc, plus a real
+ * clock for --trace and helper threads for --prefetch and --pipeline. Messages of error()
+ * rely on shecc's calling convention and are not reliable here. */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define __syscall_write 1
+
+static int __syscall(int number, int fd, char *buf, int len)
+{
+    (void) number;
+    return write(fd, buf, len);
+}
+
+static int __format(char *buf, int n, int width, int zero_pad, int base, int pp)
+{
+    (void) width;
+    (void) zero_pad;
+    (void) pp;
+    return sprintf(buf, base == 16 ? "%x" : base == 8 ? "%o" : "%d", n);
+}
+
+/* Microseconds since the first call, timestamps of --trace */
+#define SHEPHERD_MONOTONIC_CLOCK
+
+static int shepherd_monotonic_us(void)
+{
+    static struct timespec start;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (!start.tv_sec && !start.tv_nsec)
+        start = now;
+
+    return (now.tv_sec - start.tv_sec) * 1000000 +
+           (now.tv_nsec - start.tv_nsec) / 1000;
+}
+
+/* Helper threads sharing one lock and one condition, which waiters recheck
+ * after every wake up */
+#define SHEPHERD_THREADS
+
+static pthread_mutex_t shepherd_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t shepherd_cond = PTHREAD_COND_INITIALIZER;
+
+typedef struct {
+    void (*fn)(void *);
+    void *arg;
+} shepherd_thread_t;
+
+static void *shepherd_thread_main(void *data)
+{
+    shepherd_thread_t thread = *(shepherd_thread_t *) data;
+
+    free(data);
+    thread.fn(thread.arg);
+    return NULL;
+}
+
+/* Runs fn(arg) on a new detached thread */
+static void shepherd_thread_start(void (*fn)(void *), void *arg)
+{
+    shepherd_thread_t *data = malloc(sizeof(shepherd_thread_t));
+    pthread_t thread;
+
+    data->fn = fn;
+    data->arg = arg;
+    pthread_create(&thread, NULL, shepherd_thread_main, data);
+    pthread_detach(thread);
+}
+
+static void shepherd_lock(void)
+{
+    pthread_mutex_lock(&shepherd_mutex);
+}
+
+static void shepherd_unlock(void)
+{
+    pthread_mutex_unlock(&shepherd_mutex);
+}
+
+/* Releases the lock until shepherd_signal, then takes it again */
+static void shepherd_wait(void)
+{
+    pthread_cond_wait(&shepherd_cond, &shepherd_mutex);
+}
+
+static void shepherd_signal(void)
+{
+    pthread_cond_broadcast(&shepherd_cond);
+}
+
+/* Ints shared by exactly two threads without the lock, such as the indices of
+ * a pipelined lexer's ring: a store publishes everything its thread wrote
+ * before it to the thread that loads the stored value */
+static int shepherd_load(int *ptr)
+{
+    return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+}
+
+static void shepherd_store(int *ptr, int value)
+{
+    __atomic_store_n(ptr, value, __ATOMIC_RELEASE);
+}
+
+/* Lets other threads run while waiting for a shepherd_store */
+static void shepherd_yield(void)
+{
+    sched_yield();
+}
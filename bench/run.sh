@@ -0,0 +1,65 @@
+#!/bin/sh
+# Benchmark harness for `make bench`.
+#
+# Usage: bench/run.sh <work dir> <shepherd binary>...
+#
+# Generates every corpus kind into the work dir once, then lexes each corpus
+# REPEAT times per run with --count and reports throughput and peak RSS of
+# every binary.
+
+set -e
+
+WORK=$1
+shift
+
+KINDS="ident punct comment string macro cond"
+# Every corpus file has to fit in MAX_SOURCE
+BYTES=${BENCH_BYTES:-180000}
+REPEAT=${BENCH_REPEAT:-25}
+
+mkdir -p "$WORK"
+
+for kind in $KINDS; do
+    if [ ! -f "$WORK/$kind.c" ]; then
+        "$WORK/gen_corpus" "$kind" "$BYTES" > "$WORK/$kind.c"
+    fi
+done
+
+now_ns() {
+    date +%s%N
+}
+
+printf "%-10s %-22s %10s %12s %10s %12s\n" \
+    corpus binary "MB/s" "tokens/s" "ns/token" "peak RSS KB"
+
+for kind in $KINDS; do
+    file="$WORK/$kind.c"
+    size=$(wc -c < "$file")
+    args=""
+    i=0
+    while [ $i -lt "$REPEAT" ]; do
+        args="$args $file"
+        i=$((i + 1))
+    done
+
+    for bin in "$@"; do
+        rss="n/a"
+        start=$(now_ns)
+        if [ -x /usr/bin/time ]; then
+            tokens=$(/usr/bin/time -f "%M" -o "$WORK/rss" "$bin" --count $args)
+            rss=$(tail -n 1 "$WORK/rss")
+        else
+            tokens=$("$bin" --count $args)
+        fi
+        end=$(now_ns)
+
+        awk -v kind="$kind" -v bin="$bin" -v ns=$((end - start)) \
+            -v bytes=$((size * REPEAT)) -v tokens="$tokens" -v rss="$rss" \
+            'BEGIN {
+                if (ns <= 0) ns = 1;
+                printf "%-10s %-22s %10.2f %12.0f %10.1f %12s\n", kind, bin,
+                       bytes / 1048576 / (ns / 1e9), tokens / (ns / 1e9),
+                       tokens ? ns / tokens : 0, rss
+            }'
+    done
+done
@@ -7,9 +7,47 @@
 #define MAX_LINE_LEN 256
 #define MAX_SOURCE 200000
 #define MAX_TOKEN_LEN 256
-#define MAX_FILE 32
-#define MAX_PATH_LEN 32
-#define MAX_MACROS 1024
+/* File map starts with FILE_MAP_SIZE entries and grows up to MAX_FILES */
+#define FILE_MAP_SIZE 32
+#define MAX_FILES 65536
+#define MAX_PATH_LEN 4096
+#define MAX_INCLUDE_PATHS 32
+#define EMIT_BUFFER_SIZE 65536
+#define LEXER_BATCH_SIZE 64
+#define LEXER_RING_SIZE 1024 /* power of two */
+#define LEXER_RING_SYNC 256 /* tokens between hand-offs of a pipelined lexer */
+#define LEXER_CACHE_LINE 128
+#define RELEX_CHECKPOINT_INTERVAL 64
+#define STATS_TOKEN_TYPES 128
+#define TRACE_EVENTS 65536
+#define TRACE_NAME_LEN 64
+#define EMIT_MAX_LINE_GAP 8
+#define STRING_CHUNK_SIZE 65536
+#define MACRO_CHUNK_SIZE 1024
+#define MACRO_BUCKETS_SIZE 1024
+/* Macro tables are split into pages of MACRO_PAGE_SIZE entries or bucket
+ * heads, MACRO_BUCKET_PAGES is MACRO_BUCKETS_SIZE / MACRO_PAGE_SIZE. Their
+ * page directory starts with room for MACRO_PAGES pages and doubles. */
+#define MACRO_PAGE_SIZE 64
+#define MACRO_PAGES 64
+#define MACRO_BUCKET_PAGES 16
+#define MAX_KEYWORDS 32
+#define KEYWORD_BUCKETS_SIZE 64
+#define MAX_COND_DEPTH 64
+#define MAX_COND_TERMS 256
+#define MAX_DIRECTIVE_LEN 16
+#define COND_CACHE_SIZE 256
+#define MAX_COND_DEPS 16
+#define INCLUDE_CACHE_SIZE 256
+#define PATH_CACHE_SIZE 256
+#define SYMBOL_TABLE_SIZE 1024
+#define SYMBOL_CHUNK_SIZE 16384
+#define DIAG_MSG_LEN 100
+
+/* Identifier hashing (djb2), masked to 24 bits so that every step stays in
+ * range of a signed int. */
+#define HASH_SEED 5381
+#define HASH_MASK 0xffffff
 
 typedef enum {
     T_numeric,
@@ -94,23 +132,187 @@ typedef struct {
     int file_idx;
     int line;
     int col;
+    /* Byte offset into the source of file_idx */
+    int offset;
 } location_t;
 
+/* Error recorded by a lexer context instead of exiting */
+typedef struct {
+    char message[DIAG_MSG_LEN];
+    location_t loc;
+} diagnostic_t;
+
+/* Diagnostics sink of a lexer context, see lexer_collect_diagnostics */
+typedef struct {
+    diagnostic_t *items;
+    int len;
+    int capacity;
+    /* Input is abandoned once this many errors are recorded, 0 for no limit */
+    int limit;
+} diagnostics_t;
+
+/* Token flags */
+#define TK_LEADING_SPACE 1 /* white space or comment right before it */
+#define TK_LINE_START 2    /* first token on its line */
+#define TK_EXPANDED 4      /* produced by macro expansion */
+
+/* Numeric literal flags, integers wrap to int and floating values are
+ * truncated toward zero since there is no floating type to hold them */
+#define NUM_FLOAT 1     /* floating literal */
+#define NUM_UNSIGNED 2  /* u or U suffix */
+#define NUM_LONG 4      /* l or L suffix */
+#define NUM_LONG_LONG 8 /* ll or LL suffix */
+#define NUM_SINGLE 16   /* f or F suffix of a floating literal */
+#define NUM_INVALID 32  /* bad digit or suffix, or no digits after a prefix */
+
 typedef struct token_t token_t;
 
 struct token_t {
     int dummy;
     location_t loc;
     token_type_t typ;
+    /* Hash of identifier spelling computed while scanning, 0 otherwise */
+    int hash;
+    /* TK_* flags, spacing of the token in its source */
+    int flags;
+    /* Contents of a T_string, str_len bytes without terminator. NULL str
+     * means the contents have no escapes and are read in place, right after
+     * the opening quote at loc, see token_string. Otherwise str holds them
+     * decoded in string storage. literal only keeps their first
+     * MAX_TOKEN_LEN - 1 bytes. Kinds-only lexers leave escaped contents
+     * undecoded, with their raw length in len, see token_string. */
+    char *str;
+    int str_len;
+    /* Value and NUM_* flags of a T_numeric, computed while scanning */
+    int value;
+    int num_flags;
+    /* Symbol id of a T_identifier's spelling, -1 for any other token, see
+     * symbol_intern */
+    int symbol;
+    /* Length of the spelling at loc.offset in source. Kinds-only lexers leave
+     * literal empty for token_literal to fill in on first use. */
+    int len;
     char literal[MAX_TOKEN_LEN];
     token_t *next;
 };
 
+/* Macro name and replacement list live back-to-back in the macro arena as one
+ * contiguous, immutable token array: name is the first element and
+ * replacement points right after it. */
 typedef struct {
     token_t *name;
     token_t *replacement;
+    int replacement_len;
     bool functiono_like;
     bool disabled;
+    /* false once #undef'd, the entry itself stays for its name */
+    bool defined;
+    /* Set from a run-wide counter on every #define or #undef of this name, so
+     * results derived from the macro are invalidated without scanning the
+     * table. No two definitions share one, even in tables restored from an
+     * older fork. */
+    int generation;
+    /* Symbol id and hash of the name, entries are looked up by them */
+    int symbol;
+    int hash;
+    /* Index of next macro in the same bucket chain, -1 terminates */
+    int bucket_next;
 } macro_t;
 
+/* Pages are reference counted and shared between forked macro tables, a page
+ * is copied on the first write through a table that does not own it alone. */
+typedef struct {
+    int refs;
+    macro_t macros[MACRO_PAGE_SIZE];
+} macro_page_t;
+
+typedef struct {
+    int refs;
+    int heads[MACRO_PAGE_SIZE];
+} macro_bucket_page_t;
+
+/* Page directory, shared between forked macro tables like the pages it
+ * holds and copied on the first write through a table that does not own it
+ * alone. NULL pages are empty. */
+typedef struct {
+    int refs;
+    int capacity;
+    macro_page_t **pages;
+} macro_dir_t;
+
+/* Persistent macro table, a NULL dir holds no page yet */
+typedef struct {
+    int len;
+    macro_dir_t *dir;
+    macro_bucket_page_t *buckets[MACRO_BUCKET_PAGES];
+} macro_table_t;
+
+typedef struct {
+    char *name;
+    int hash;
+    token_type_t typ;
+} keyword_t;
+
+/* Hot path counters reported by --stats, only maintained by builds with
+ * SHEPHERD_STATS defined (`make STATS=1`). Memory is counted in allocations
+ * and tokens, so that no counter overflows on large inputs. */
+typedef struct {
+    int tokens[STATS_TOKEN_TYPES];
+    int white_space_bytes;
+    int comment_bytes;
+    int dead_bytes;
+    int find_macro_calls;
+    int find_macro_hits;
+    int expansions;
+    int max_stack_depth;
+    int arena_chunks;
+    int arena_tokens;
+    int macro_chunks;
+    int macro_tokens;
+    int reg_lexers;
+    int include_lookups;
+    int include_cache_hits;
+    int file_probes;
+    int include_prefetches;
+} stats_t;
+
+/* Owners of heap memory reported by lexer_memory_stats */
+typedef enum {
+    MEM_arena,      /* token arena chunks */
+    MEM_macros,     /* macro token chunks and macro table pages */
+    MEM_sources,    /* source buffers held in FILE_SOURCES */
+    MEM_reg_lexers, /* regional lexer structs */
+    MEM_interning,  /* condition cache, symbols and snapshot string pools */
+    MEM_strings,    /* decoded string literals */
+    MEM_total       /* sum of every owner above */
+} mem_owner_t;
+
+#define MEM_OWNERS 7
+
+/* Bytes held by one owner, cap of 0 means unlimited */
+typedef struct {
+    int current;
+    int peak;
+    int cap;
+} mem_usage_t;
+
+typedef struct {
+    mem_usage_t owners[MEM_OWNERS];
+} memory_stats_t;
+
+/* Answer of a token sink to a batch */
+typedef enum {
+    TS_continue,  /* every token of the batch is consumed */
+    TS_stop,      /* lexer_run returns right away */
+    TS_lookahead, /* nothing is consumed, the batch comes again with more
+                     tokens appended */
+} token_sink_result_t;
+
+/* Consumer driven by lexer_run, tokens are copies that stay valid during the
+ * call only, flags and loc of each are what lexer_cur_token_flags and
+ * lexer_cur_token_loc report. The last batch ends with T_eof. */
+typedef token_sink_result_t (*token_sink_t)(token_t *tokens,
+                                            int len,
+                                            void *user);
+
 #endif
@@ -0,0 +1,189 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+
+/* Token dump, fully preprocessed token stream of one input, which can be
+ * replayed through the usual lexer API without lexing anything, e.g. to drive
+ * a parser on its own or to skip inputs that did not change.
+ *
+ * Layout follows prelude snapshots, every int is 32-bit little-endian:
+ *
+ *   header:  magic, version, files_len, tokens_len, strings_size
+ *   files:   path_off, size, content_hash      (validity of the dump)
+ *   tokens:  typ, flags, file_idx, line, col, offset, literal_off
+ *   strings: NUL-terminated spellings, each distinct one stored once, as in
+ *            snapshots
+ *
+ * Flags and location are the ones lexer_cur_token_flags and
+ * lexer_cur_token_loc reported while dumping. */
+
+#define DUMP_MAGIC 0x54504853 /* "SHPT" */
+#define DUMP_VERSION 3
+#define DUMP_TOKEN_INTS 7
+
+/* Lexes lexer to its end and writes every token to dump_path */
+void lexer_dump(lexer_t *lexer, char *dump_path)
+{
+    snapshot_strings_t *strings = snapshot_strings_init();
+    int capacity = 1024 * DUMP_TOKEN_INTS, len = 0;
+    int *records = malloc(capacity * sizeof(int)), *paths;
+    FILE *f;
+
+    while (lexer_next_token(lexer) != T_eof) {
+        token_t *token = lexer_cur_token(lexer);
+        location_t *loc = lexer_cur_token_loc(lexer);
+
+        if (len + DUMP_TOKEN_INTS > capacity) {
+            int *grown = malloc(capacity * 2 * sizeof(int));
+
+            memcpy(grown, records, len * sizeof(int));
+            free(records);
+            records = grown;
+            capacity *= 2;
+        }
+
+        records[len++] = token->typ;
+        records[len++] = lexer_cur_token_flags(lexer);
+        records[len++] = loc->file_idx;
+        records[len++] = loc->line;
+        records[len++] = loc->col;
+        records[len++] = loc->offset;
+        records[len++] = snapshot_intern_token(strings, token);
+    }
+
+    paths = malloc(file_map_idx * sizeof(int));
+    for (int i = 0; i < file_map_idx; i++)
+        paths[i] = snapshot_intern(strings, FILE_NAMES[i]);
+
+    f = fopen(dump_path, "wb");
+    if (!f) {
+        printf("[%s] Error: Failed to write token dump\n", dump_path);
+        exit(1);
+    }
+
+    snapshot_write_int(f, DUMP_MAGIC);
+    snapshot_write_int(f, DUMP_VERSION);
+    snapshot_write_int(f, file_map_idx);
+    snapshot_write_int(f, len / DUMP_TOKEN_INTS);
+    snapshot_write_int(f, strings->size);
+
+    for (int i = 0; i < file_map_idx; i++) {
+        int source_len = strlen(FILE_SOURCES[i]);
+
+        snapshot_write_int(f, paths[i]);
+        snapshot_write_int(f, source_len);
+        snapshot_write_int(f,
+                           snapshot_content_hash(FILE_SOURCES[i], source_len));
+    }
+
+    for (int i = 0; i < len; i++)
+        snapshot_write_int(f, records[i]);
+
+    for (int i = 0; i < strings->size; i++)
+        fputc(strings->data[i], f);
+
+    fclose(f);
+    free(paths);
+    free(records);
+    snapshot_strings_free(strings);
+}
+
+/* Returns lexer context replaying dump_path, or NULL if the dump is missing,
+ * malformed or any file it was taken from changed since. Files of the dump
+ * are added to file map, so locations keep pointing at them. */
+lexer_t *lexer_load_dump(char *dump_path)
+{
+    int files_len, tokens_len, strings_size, base = -1;
+    int *files = NULL, *records = NULL;
+    char *strings = NULL;
+    token_t *tokens;
+    lexer_t *lexer;
+    bool valid;
+    FILE *f = fopen(dump_path, "rb");
+
+    if (!f)
+        return NULL;
+
+    snapshot_truncated = false;
+    valid = snapshot_read_int(f) == DUMP_MAGIC &&
+            snapshot_read_int(f) == DUMP_VERSION;
+
+    files_len = snapshot_read_int(f);
+    tokens_len = snapshot_read_int(f);
+    strings_size = snapshot_read_int(f);
+
+    valid = valid && !snapshot_truncated && files_len > 0 &&
+            files_len <= MAX_FILES && tokens_len >= 0 && strings_size > 0;
+
+    if (valid) {
+        files = malloc(files_len * 3 * sizeof(int));
+        for (int i = 0; i < files_len * 3; i++)
+            files[i] = snapshot_read_int(f);
+
+        records = malloc((tokens_len * DUMP_TOKEN_INTS + 1) * sizeof(int));
+        for (int i = 0; i < tokens_len * DUMP_TOKEN_INTS; i++)
+            records[i] = snapshot_read_int(f);
+
+        strings = malloc(strings_size);
+        for (int i = 0; i < strings_size; i++)
+            strings[i] = snapshot_read_byte(f);
+        strings[strings_size - 1] = '\0';
+
+        valid = !snapshot_truncated;
+        for (int i = 0; valid && i < files_len; i++)
+            valid = files[i * 3] >= 0 && files[i * 3] < strings_size;
+        for (int i = 0; valid && i < tokens_len; i++) {
+            int *record = &records[i * DUMP_TOKEN_INTS];
+
+            valid = record[0] >= 0 && record[0] <= T_backslash &&
+                    record[2] >= 0 && record[2] < files_len && record[6] >= 0 &&
+                    record[6] < strings_size &&
+                    (record[0] == T_string ||
+                     strlen(strings + record[6]) < MAX_TOKEN_LEN);
+        }
+    }
+
+    fclose(f);
+
+    if (valid)
+        base = snapshot_map_files(files, files_len, strings);
+
+    if (base < 0) {
+        free(strings);
+        free(records);
+        free(files);
+        return NULL;
+    }
+
+    tokens = malloc((tokens_len + 1) * sizeof(token_t));
+    for (int i = 0; i < tokens_len; i++) {
+        int *record = &records[i * DUMP_TOKEN_INTS];
+        token_t *token = &tokens[i];
+
+        token->typ = record[0];
+        token->flags = record[1];
+        token->loc.file_idx = base + record[2];
+        token->loc.line = record[3];
+        token->loc.col = record[4];
+        token->loc.offset = record[5];
+        snapshot_read_spelling(token, strings + record[6]);
+        token->hash = token->typ != T_string && token->typ != T_char &&
+                              is_identifier_start(token->literal[0])
+                          ? hash_identifier(token->literal)
+                          : 0;
+        token->next = NULL;
+    }
+
+    lexer = lexer_create(NULL, macro_table_init());
+    lexer->replay = tokens;
+    lexer->global_lexer =
+        reg_lexer_token_init(lexer->arena, tokens, tokens_len, base);
+
+    free(strings);
+    free(records);
+    free(files);
+    return lexer;
+}
@@ -0,0 +1,247 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+
+/* Preprocessed output (-E), tokens are written back as C text spaced as in
+ * their source, with line markers wherever output moves to another file or
+ * skips too many lines. Text is gathered in one large buffer that goes to the
+ * kernel in a single write each time it fills up. */
+
+typedef struct {
+    char data[EMIT_BUFFER_SIZE];
+    int len;
+    int fd;
+    /* File and line the output is at, file_idx is -1 before any token */
+    int file_idx;
+    int line;
+    bool line_empty;
+    /* Last character of previous token and whether it was expanded */
+    char last;
+    bool last_expanded;
+} emitter_t;
+
+emitter_t *emit_init(int fd)
+{
+    emitter_t *emitter = malloc(sizeof(emitter_t));
+    emitter->len = 0;
+    emitter->fd = fd;
+    emitter->file_idx = -1;
+    emitter->line = 0;
+    emitter->line_empty = true;
+    emitter->last = '\0';
+    emitter->last_expanded = false;
+    return emitter;
+}
+
+void emit_write_fd(int fd, char *data, int len)
+{
+    while (len > 0) {
+        int written = __syscall(__syscall_write, fd, data, len);
+
+        if (written <= 0) {
+            printf("Error: Failed to write preprocessed output\n");
+            exit(1);
+        }
+
+        data += written;
+        len -= written;
+    }
+}
+
+void emit_flush(emitter_t *emitter)
+{
+    emit_write_fd(emitter->fd, emitter->data, emitter->len);
+    emitter->len = 0;
+}
+
+void emit_write(emitter_t *emitter, char *data, int len)
+{
+    if (emitter->len + len > EMIT_BUFFER_SIZE)
+        emit_flush(emitter);
+
+    /* Anything larger than the whole buffer bypasses it */
+    if (len > EMIT_BUFFER_SIZE) {
+        emit_write_fd(emitter->fd, data, len);
+        return;
+    }
+
+    memcpy(emitter->data + emitter->len, data, len);
+    emitter->len += len;
+}
+
+void emit_char(emitter_t *emitter, char ch)
+{
+    if (emitter->len == EMIT_BUFFER_SIZE)
+        emit_flush(emitter);
+
+    emitter->data[emitter->len++] = ch;
+}
+
+void emit_str(emitter_t *emitter, char *str)
+{
+    emit_write(emitter, str, strlen(str));
+}
+
+void emit_int(emitter_t *emitter, int value)
+{
+    char digits[12];
+    int len = 0;
+
+    do {
+        digits[len++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+
+    while (len)
+        emit_char(emitter, digits[--len]);
+}
+
+/* Writes len decoded bytes at str back with quotes and escapes */
+void emit_quoted(emitter_t *emitter, char *str, int len, char quote)
+{
+    emit_char(emitter, quote);
+
+    for (int i = 0; i < len; i++) {
+        char ch = str[i];
+
+        if (ch == '\n') {
+            emit_str(emitter, "\\n");
+        } else if (ch == '\r') {
+            emit_str(emitter, "\\r");
+        } else if (ch == '\t') {
+            emit_str(emitter, "\\t");
+        } else if ((ch >= 0 && ch < ' ') || ch == 127) {
+            /* Always 3 octal digits, so digits that follow stay apart */
+            emit_char(emitter, '\\');
+            emit_char(emitter, '0' + (ch >> 6));
+            emit_char(emitter, '0' + (ch >> 3 & 7));
+            emit_char(emitter, '0' + (ch & 7));
+        } else {
+            if (ch == '\\' || ch == quote)
+                emit_char(emitter, '\\');
+            emit_char(emitter, ch);
+        }
+    }
+
+    emit_char(emitter, quote);
+}
+
+void emit_line_marker(emitter_t *emitter, location_t *loc)
+{
+    if (!emitter->line_empty)
+        emit_char(emitter, '\n');
+
+    emit_str(emitter, "# ");
+    emit_int(emitter, loc->line);
+    emit_str(emitter, " \"");
+    for (char *p = file_name(loc->file_idx); *p; p++) {
+        if (*p == '\\' || *p == '"')
+            emit_char(emitter, '\\');
+        emit_char(emitter, *p);
+    }
+    emit_str(emitter, "\"\n");
+
+    emitter->file_idx = loc->file_idx;
+    emitter->line = loc->line;
+    emitter->line_empty = true;
+}
+
+bool emit_is_punctuator(char ch)
+{
+    char *set = "+-*/%&|^<>=!#.:";
+
+    for (char *p = set; *p; p++)
+        if (*p == ch)
+            return true;
+    return false;
+}
+
+/* Whether two characters written back to back could lex as one token */
+bool emit_would_paste(char prev, char next)
+{
+    if (is_identifier(prev) && (is_identifier(next) || next == '.'))
+        return true;
+    if (prev == '.' && is_digit(next))
+        return true;
+    /* Exponent of a number, spaces after identifiers ending alike are harmless */
+    if ((prev == 'e' || prev == 'E' || prev == 'p' || prev == 'P') &&
+        (next == '+' || next == '-'))
+        return true;
+    return emit_is_punctuator(prev) && emit_is_punctuator(next);
+}
+
+void emit_token(emitter_t *emitter,
+                token_t *token,
+                int flags,
+                location_t *loc)
+{
+    char *literal = token_literal(token);
+    bool expanded = flags & TK_EXPANDED;
+
+    if (loc->file_idx != emitter->file_idx) {
+        emit_line_marker(emitter, loc);
+    } else if (flags & TK_LINE_START) {
+        int gap = loc->line - emitter->line;
+
+        if (gap < 0 || gap > EMIT_MAX_LINE_GAP) {
+            emit_line_marker(emitter, loc);
+        } else {
+            if (!gap && !emitter->line_empty)
+                gap = 1;
+            for (int i = 0; i < gap; i++)
+                emit_char(emitter, '\n');
+            emitter->line = loc->line;
+            emitter->line_empty = true;
+        }
+    }
+
+    if (emitter->line_empty) {
+        /* Keeps indentation, every white space character counts as one */
+        for (int i = 1; i < loc->col; i++)
+            emit_char(emitter, ' ');
+    } else if (flags & TK_LEADING_SPACE) {
+        emit_char(emitter, ' ');
+    } else if ((expanded || emitter->last_expanded) &&
+               emit_would_paste(emitter->last,
+                                token->typ == T_string ? '"' : literal[0])) {
+        emit_char(emitter, ' ');
+    }
+
+    if (token->typ == T_string && !token->str) {
+        /* Contents read in place have no escapes, they go out as they are */
+        emit_char(emitter, '"');
+        emit_write(emitter, token_string(token), token->str_len);
+        emit_char(emitter, '"');
+    } else if (token->typ == T_string)
+        emit_quoted(emitter, token_string(token), token->str_len, '"');
+    else if (token->typ == T_char)
+        emit_quoted(emitter, literal, 1, '\'');
+    else
+        emit_str(emitter, literal);
+
+    emitter->line_empty = false;
+    emitter->last = token->typ == T_string || token->typ == T_char
+                        ? '"'
+                        : literal[strlen(literal) - 1];
+    emitter->last_expanded = expanded;
+}
+
+/* Writes every token of lexer */
+void emit_lexer(emitter_t *emitter, lexer_t *lexer)
+{
+    while (lexer_next_token(lexer) != T_eof)
+        emit_token(emitter, lexer_cur_token(lexer),
+                   lexer_cur_token_flags(lexer), lexer_cur_token_loc(lexer));
+}
+
+void emit_free(emitter_t *emitter)
+{
+    if (!emitter->line_empty)
+        emit_char(emitter, '\n');
+
+    emit_flush(emitter);
+    free(emitter);
+}
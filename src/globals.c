@@ -3,23 +3,235 @@
 #include <string.h>
 #include "defs.h"
 
+/* File map, growable vectors indexed by file_idx */
 int file_map_idx = 0;
-char *FILE_NAMES[MAX_FILE];
-char *FILE_SOURCES[MAX_FILE];
+int file_map_capacity = 0;
+char **FILE_NAMES;
+char **FILE_SOURCES;
+/* Whether #include targets of the file were prefetched already */
+bool *FILE_PREFETCHED;
+/* Open addressing index of shared files by path, which #include resolution
+ * always normalizes. Stores file_idx + 1, 0 marks an empty slot, holds twice
+ * file_map_capacity slots. */
+int *FILE_INDEX;
 
-int macros_idx = 0;
-macro_t *MACROS;
+stats_t STATS;
+/* Process-wide, every lexer context counts against the same owners and caps */
+memory_stats_t MEMORY;
+/* Owner whose cap an allocation exceeded plus one, 0 if none. Reported by
+ * lexer_enter when the lexer context collects diagnostics. */
+int memory_exceeded = 0;
+/* Sink of the lexer context being driven, if any. Errors with a location are
+ * recorded there instead of exiting. */
+diagnostics_t *DIAGNOSTICS;
 
-int file_map_add_entry(char *file_path, char **source_ref, int *len_ref)
+int include_paths_idx = 0;
+char *INCLUDE_PATHS[MAX_INCLUDE_PATHS];
+bool PREFETCH_INCLUDES = false;
+
+/* Every candidate path #include has probed, found or not, so that probing it
+ * again costs no syscall. It stands in for listings of the search
+ * directories, which shecc's libc cannot read. Open addressing, grows at 3/4
+ * load. */
+typedef struct {
+    char *path;
+    int hash;
+    /* -1 if the path cannot be read */
+    int file_idx;
+    int len;
+    /* Index + 1 in PREFETCHES while the read is left to the prefetch thread,
+     * 0 otherwise */
+    int prefetch;
+} path_entry_t;
+
+path_entry_t *PATH_CACHE;
+int path_cache_len;
+int path_cache_capacity;
+/* Bumped by lexer_reset_file_cache, so resolutions cached by lexer contexts
+ * are dropped as well */
+int file_cache_epoch = 0;
+
+#ifdef SHEPHERD_THREADS
+/* Headers read by the prefetch thread, in the order they are queued. The
+ * thread only touches the queue, under the shepherd lock, and file contents;
+ * everything else is left to the lexer's thread. */
+typedef enum {
+    PF_queued,
+    PF_reading,
+    PF_ready,
+    PF_main /* left for the lexer's thread to read */
+} prefetch_state_t;
+
+typedef struct {
+    char *path;
+    /* Unaccounted until taken, NULL if the file cannot be read */
+    char *source;
+    int len;
+    prefetch_state_t state;
+    /* First candidate path of an #include, the thread skips the rest of them
+     * once one is found */
+    bool first;
+} prefetch_t;
+
+prefetch_t *PREFETCHES = NULL;
+int prefetches_len = 0;
+int prefetches_capacity = 0;
+/* Next entry for the thread to look at */
+int prefetch_next = 0;
+bool prefetch_running = false;
+/* Set by prefetch_stop, the thread returns once it sees it */
+bool prefetch_stopping = false;
+#endif
+
+/* Last macro generation handed out, see macro_t */
+int macro_generation = 0;
+
+int keywords_idx = 0;
+keyword_t KEYWORDS[MAX_KEYWORDS];
+/* Open addressing table over KEYWORDS, stores index + 1, 0 marks empty slot */
+int KEYWORD_BUCKETS[KEYWORD_BUCKETS_SIZE];
+
+typedef struct macro_chunk_t macro_chunk_t;
+
+struct macro_chunk_t {
+    macro_chunk_t *next;
+    int size;
+    int capacity;
+    token_t *data;
+};
+
+/* Dedicated storage for macro names and bodies, newest chunk first. */
+macro_chunk_t *MACRO_CHUNKS;
+
+typedef struct string_chunk_t string_chunk_t;
+
+struct string_chunk_t {
+    string_chunk_t *next;
+    int size;
+    int capacity;
+    char *data;
+};
+
+/* Storage for decoded string literals, lives as long as macro storage since
+ * macro bodies refer to it. */
+string_chunk_t *STRING_CHUNKS;
+
+/* Interned identifier spellings. Symbol ids index SYMBOLS densely in order of
+ * first sight and hold for the whole run, so every lexer context, fork and
+ * restored snapshot agrees on them. */
+typedef struct {
+    char *name;
+    int len;
+    int hash;
+} symbol_t;
+
+symbol_t *SYMBOLS;
+int symbols_len;
+int symbols_capacity;
+/* Open addressing over SYMBOLS by hash, stores id + 1, 0 marks an empty slot,
+ * holds twice symbols_capacity slots. */
+int *SYMBOL_BUCKETS;
+/* Storage of symbol names, newest chunk first */
+string_chunk_t *SYMBOL_CHUNKS;
+
+void error(char *str, location_t *location, ...);
+
+char *memory_owner_name(int owner)
+{
+    if (owner == MEM_arena)
+        return "arena";
+    if (owner == MEM_macros)
+        return "macros";
+    if (owner == MEM_sources)
+        return "sources";
+    if (owner == MEM_reg_lexers)
+        return "lexers";
+    if (owner == MEM_interning)
+        return "interning";
+    if (owner == MEM_strings)
+        return "strings";
+    return "total";
+}
+
+/* Current and peak bytes of every owner, counted since startup */
+memory_stats_t *lexer_memory_stats()
+{
+    return &MEMORY;
+}
+
+/* Limits owner, or every owner together with MEM_total, to cap bytes, 0
+ * removes the limit. An allocation beyond it is fatal, unless the lexer
+ * context collects diagnostics: then it is recorded as an error at the next
+ * token and the input is abandoned. */
+void lexer_set_memory_cap(int owner, int cap)
 {
-    char buffer[MAX_LINE_LEN], source = calloc(MAX_SOURCE, sizeof(char));
+    MEMORY.owners[owner].cap = cap;
+}
+
+void memory_account_owner(int owner, int size)
+{
+    mem_usage_t *usage = &MEMORY.owners[owner];
+
+    usage->current += size;
+    if (usage->current > usage->peak)
+        usage->peak = usage->current;
+
+    if (size <= 0 || !usage->cap || usage->current <= usage->cap)
+        return;
+
+    if (DIAGNOSTICS) {
+        if (!memory_exceeded)
+            memory_exceeded = owner + 1;
+        return;
+    }
+
+    /* A limit set by the user, not an internal error */
+    printf("Error: Memory cap of %d bytes exceeded by %s\n", usage->cap,
+           memory_owner_name(owner));
+    exit(1);
+}
+
+/* Counts size bytes more, or fewer if negative, against owner */
+void memory_account(int owner, int size)
+{
+    memory_account_owner(owner, size);
+    memory_account_owner(MEM_total, size);
+}
+
+void *mem_alloc(int owner, int size)
+{
+    memory_account(owner, size);
+    return malloc(size);
+}
+
+void *mem_calloc(int owner, int size)
+{
+    memory_account(owner, size);
+    return calloc(1, size);
+}
+
+/* Releases ptr of size bytes allocated by mem_alloc or mem_calloc */
+void mem_free(int owner, void *ptr, int size)
+{
+    if (!ptr)
+        return;
+    memory_account(owner, -size);
+    free(ptr);
+}
+
+/* Reads whole file into a newly allocated buffer, returns NULL if the file
+ * cannot be opened. Leaves the buffer unaccounted, so that it is safe to call
+ * from a helper thread. */
+char *file_read_unaccounted(char *file_path, int *len_ref)
+{
+    char buffer[MAX_LINE_LEN], *source;
     int length = 0;
     FILE *f = fopen(file_path, "rb");
 
-    if (!f) {
-        printf("[%s] Error: Failed to read file\n", file_path);
-        exit(1);
-    }
+    if (!f)
+        return NULL;
+
+    source = calloc(1, MAX_SOURCE);
 
     for (;;) {
         if (!fgets(buffer, MAX_LINE_LEN, f))
@@ -30,60 +242,1405 @@ int file_map_add_entry(char *file_path, char **source_ref, int *len_ref)
     }
     fclose(f);
 
-    FILE_NAMES[file_map_idx] = calloc(strlen(file_path) + 1, sizeof(char));
-    strcpy(FILE_NAMES[file_map_idx], file_path);
-    FILE_SOURCES[file_map_idx++] = source;
+    len_ref[0] = length;
+    return source;
+}
+
+/* Reads whole file into a newly allocated buffer owned by MEM_sources,
+ * returns NULL if the file cannot be opened. */
+char *file_read(char *file_path, int *len_ref)
+{
+    char *source = file_read_unaccounted(file_path, len_ref);
+
+    if (source)
+        memory_account(MEM_sources, MAX_SOURCE);
+    return source;
+}
+
+void file_source_free(char *source)
+{
+    mem_free(MEM_sources, source, MAX_SOURCE);
+}
+
+int hash_identifier(char *name);
+
+/* Slot of file_path in FILE_INDEX, either holding it or empty */
+int file_index_slot(char *file_path)
+{
+    int mask = file_map_capacity * 2 - 1;
+    int slot = hash_identifier(file_path) & mask;
+
+    while (FILE_INDEX[slot] &&
+           strcmp(FILE_NAMES[FILE_INDEX[slot] - 1], file_path))
+        slot = (slot + 1) & mask;
+
+    return slot;
+}
+
+/* Shared file already loaded from file_path, -1 if there is none */
+int file_map_find(char *file_path)
+{
+    if (!file_map_capacity)
+        return -1;
+
+    return FILE_INDEX[file_index_slot(file_path)] - 1;
+}
+
+void *file_map_resize(void *data, int size, int new_size)
+{
+    void *resized = mem_alloc(MEM_sources, new_size);
+
+    if (size)
+        memcpy(resized, data, size);
+    mem_free(MEM_sources, data, size);
+    return resized;
+}
+
+void file_map_grow()
+{
+    int capacity = file_map_capacity ? file_map_capacity * 2 : FILE_MAP_SIZE;
+    int *index, old_capacity;
+
+    if (capacity > MAX_FILES)
+        error("Too many files, at most %d are supported", NULL, MAX_FILES);
+
+#ifdef SHEPHERD_THREADS
+    /* Other threads may read the file map meanwhile, see file_name */
+    shepherd_lock();
+#endif
+    FILE_NAMES = file_map_resize(FILE_NAMES, file_map_idx * sizeof(char *),
+                                 capacity * sizeof(char *));
+    FILE_SOURCES = file_map_resize(FILE_SOURCES, file_map_idx * sizeof(char *),
+                                   capacity * sizeof(char *));
+    FILE_PREFETCHED = file_map_resize(
+        FILE_PREFETCHED, file_map_idx * sizeof(bool), capacity * sizeof(bool));
+#ifdef SHEPHERD_THREADS
+    shepherd_unlock();
+#endif
+
+    /* Index is rehashed at its new size */
+    index = FILE_INDEX;
+    FILE_INDEX = mem_calloc(MEM_sources, capacity * 2 * sizeof(int));
+    old_capacity = file_map_capacity;
+    file_map_capacity = capacity;
+
+    for (int i = 0; i < old_capacity * 2; i++)
+        if (index[i])
+            FILE_INDEX[file_index_slot(FILE_NAMES[index[i] - 1])] = index[i];
+    mem_free(MEM_sources, index, old_capacity * 2 * sizeof(int));
+}
+
+/* Name of file file_idx. Safe to call from the consumer of a pipelined lexer,
+ * while its producer thread may grow the file map. */
+char *file_name(int file_idx)
+{
+    char *name;
+
+#ifdef SHEPHERD_THREADS
+    shepherd_lock();
+#endif
+    name = FILE_NAMES[file_idx];
+#ifdef SHEPHERD_THREADS
+    shepherd_unlock();
+#endif
+    return name;
+}
+
+/* Appends source to file map, which takes ownership of it. A shared file is
+ * indexed by its path so that loading it again finds it, the first one wins
+ * if several have the same path. */
+int file_map_append(char *file_path, char *source, bool shared)
+{
+    int idx = file_map_idx, slot;
+
+    if (file_map_idx == file_map_capacity)
+        file_map_grow();
+
+    FILE_NAMES[idx] = calloc(strlen(file_path) + 1, sizeof(char));
+    strcpy(FILE_NAMES[idx], file_path);
+    FILE_SOURCES[idx] = source;
+    FILE_PREFETCHED[idx] = false;
+    file_map_idx++;
+
+    if (shared) {
+        slot = file_index_slot(file_path);
+        if (!FILE_INDEX[slot])
+            FILE_INDEX[slot] = idx + 1;
+    }
+
+    return idx;
+}
+
+/* Loads entry file of a lexer context. Entries are private to their context,
+ * which may edit them in place, so they are never shared. */
+int file_map_add_entry(char *file_path, char **source_ref, int *len_ref)
+{
+    char *source = file_read(file_path, len_ref);
+
+    if (!source) {
+        printf("[%s] Error: Failed to read file\n", file_path);
+        exit(1);
+    }
 
     source_ref[0] = source;
-    len_ref[0] = length;
+    return file_map_append(file_path, source, false);
+}
+
+
+void add_include_path(char *dir)
+{
+    if (include_paths_idx < MAX_INCLUDE_PATHS)
+        INCLUDE_PATHS[include_paths_idx++] = dir;
+}
 
-    return file_map_idx - 1;
+/* Enables file_prefetch_includes on every file the lexer enters. Only builds
+ * providing SHEPHERD_THREADS (see bench/host.h) can read ahead, elsewhere it
+ * has no effect. */
+void set_include_prefetch(bool enabled)
+{
+#ifdef SHEPHERD_THREADS
+    PREFETCH_INCLUDES = enabled;
+#endif
 }
 
-macro_t *add_macro(bool function_like) {
-    macro_t *macro = &MACROS[macros_idx++];
-    macro->functiono_like = function_like;
+/* Removes `./` and `dir/../` segments in place, so one file found through
+ * different relative routes keeps one name */
+void path_normalize(char *path)
+{
+    int src = 0, dst = 0;
+
+    while (path[src]) {
+        if (path[src] == '.' && path[src + 1] == '/' &&
+            (!src || path[src - 1] == '/')) {
+            src += 2;
+            continue;
+        }
+
+        if (path[src] == '.' && path[src + 1] == '.' && path[src + 2] == '/' &&
+            (!src || path[src - 1] == '/') && dst) {
+            int prev = dst - 1;
+
+            while (prev && path[prev - 1] != '/')
+                prev--;
+
+            /* Keeps leading `../` and never climbs above root */
+            if (strncmp(path + prev, "../", 3) && prev != dst - 1) {
+                dst = prev;
+                src += 3;
+                continue;
+            }
+        }
+
+        path[dst++] = path[src++];
+    }
+
+    path[dst] = '\0';
+}
+
+path_entry_t *path_cache_slot(path_entry_t *entries,
+                              int capacity,
+                              char *path,
+                              int hash)
+{
+    int slot = hash & (capacity - 1);
+
+    while (entries[slot].path && (entries[slot].hash != hash ||
+                                  strcmp(entries[slot].path, path)))
+        slot = (slot + 1) & (capacity - 1);
+
+    return &entries[slot];
+}
+
+void path_cache_grow()
+{
+    int capacity = path_cache_capacity ? path_cache_capacity * 2
+                                       : PATH_CACHE_SIZE;
+    path_entry_t *entries =
+        mem_calloc(MEM_interning, capacity * sizeof(path_entry_t));
+
+    for (int i = 0; i < path_cache_capacity; i++) {
+        path_entry_t *entry = &PATH_CACHE[i];
+
+        if (entry->path)
+            memcpy(path_cache_slot(entries, capacity, entry->path, entry->hash),
+                   entry, sizeof(path_entry_t));
+    }
+
+    mem_free(MEM_interning, PATH_CACHE,
+             path_cache_capacity * sizeof(path_entry_t));
+    PATH_CACHE = entries;
+    path_cache_capacity = capacity;
+}
+
+#ifdef SHEPHERD_THREADS
+/* Body of the prefetch thread, reads queued paths in order until
+ * prefetch_stop */
+void prefetch_worker(void *unused)
+{
+    prefetch_t *prefetch;
+    char *source, *path;
+    int i, len;
+
+    (void) unused;
+
+    shepherd_lock();
+    while (!prefetch_stopping) {
+        if (prefetch_next >= prefetches_len) {
+            shepherd_wait();
+            continue;
+        }
+
+        i = prefetch_next++;
+        if (PREFETCHES[i].state != PF_queued)
+            continue;
+        PREFETCHES[i].state = PF_reading;
+        path = PREFETCHES[i].path;
+        shepherd_unlock();
+
+        len = 0;
+        source = file_read_unaccounted(path, &len);
+
+        shepherd_lock();
+        prefetch = &PREFETCHES[i];
+        prefetch->source = source;
+        prefetch->len = len;
+        prefetch->state = PF_ready;
+
+        /* A header found shadows the later candidates of its #include */
+        for (i++; source && i < prefetches_len && !PREFETCHES[i].first; i++)
+            if (PREFETCHES[i].state == PF_queued)
+                PREFETCHES[i].state = PF_main;
+        shepherd_signal();
+    }
+
+    prefetch_running = false;
+    shepherd_signal();
+    shepherd_unlock();
+}
+
+/* Queues path for the prefetch thread unless it was probed or queued
+ * already. Returns false if path is known to exist or is pending, so that
+ * later candidates of the same #include need no read. */
+bool prefetch_queue(char *path, bool *first_ref)
+{
+    int hash = hash_identifier(path);
+    path_entry_t *entry;
+    prefetch_t *prefetch;
+
+    if (path_cache_len * 4 >= path_cache_capacity * 3)
+        path_cache_grow();
+
+    entry = path_cache_slot(PATH_CACHE, path_cache_capacity, path, hash);
+    if (entry->path)
+        return entry->file_idx == -1 && !entry->prefetch;
+
+    /* Mapped by other means, e.g. a snapshot, probing it reads nothing */
+    if (file_map_find(path) != -1)
+        return false;
+
+    entry->path = mem_alloc(MEM_interning, strlen(path) + 1);
+    strcpy(entry->path, path);
+    entry->hash = hash;
+    entry->len = 0;
+    entry->file_idx = -1;
+    path_cache_len++;
+
+    shepherd_lock();
+    if (prefetches_len == prefetches_capacity) {
+        int capacity = prefetches_capacity * 2 + 16;
+        prefetch_t *queue =
+            mem_alloc(MEM_interning, capacity * sizeof(prefetch_t));
+
+        if (prefetches_len)
+            memcpy(queue, PREFETCHES, prefetches_len * sizeof(prefetch_t));
+        mem_free(MEM_interning, PREFETCHES,
+                 prefetches_capacity * sizeof(prefetch_t));
+        PREFETCHES = queue;
+        prefetches_capacity = capacity;
+    }
+    entry->prefetch = prefetches_len + 1;
+    prefetch = &PREFETCHES[prefetches_len++];
+    prefetch->path = entry->path;
+    prefetch->source = NULL;
+    prefetch->len = 0;
+    prefetch->state = PF_queued;
+    prefetch->first = first_ref[0];
+    shepherd_signal();
+    shepherd_unlock();
+
+    first_ref[0] = false;
+    if (!prefetch_running) {
+        prefetch_running = true;
+        shepherd_thread_start(prefetch_worker, NULL);
+    }
+    return true;
+}
+
+/* Completes entry whose read was left to the prefetch thread, waits only if
+ * the thread is reading it right now */
+void prefetch_take(path_entry_t *entry)
+{
+    prefetch_t *prefetch;
+    prefetch_state_t state;
+    char *source;
+
+    shepherd_lock();
+    prefetch = &PREFETCHES[entry->prefetch - 1];
+    /* Not started yet, reading it here beats waiting behind the queue */
+    if (prefetch->state == PF_queued)
+        prefetch->state = PF_main;
+    while (prefetch->state == PF_reading)
+        shepherd_wait();
+    state = prefetch->state;
+    source = prefetch->source;
+    entry->len = prefetch->len;
+    prefetch->source = NULL;
+    shepherd_unlock();
+
+    entry->prefetch = 0;
+    if (state == PF_main) {
+#ifdef SHEPHERD_STATS
+        STATS.file_probes++;
+#endif
+        source = file_read(entry->path, &entry->len);
+    } else if (source)
+        memory_account(MEM_sources, MAX_SOURCE);
+
+    if (source)
+        entry->file_idx = file_map_append(entry->path, source, true);
+}
+
+/* Lets the prefetch thread finish what it is reading, then empties the
+ * queue, dropping headers that were never asked for. Entries of PATH_CACHE
+ * still pending must be dropped too. */
+void prefetch_drain()
+{
+    shepherd_lock();
+    for (int i = 0; i < prefetches_len; i++) {
+        if (PREFETCHES[i].state == PF_queued)
+            PREFETCHES[i].state = PF_main;
+        while (PREFETCHES[i].state == PF_reading)
+            shepherd_wait();
+        free(PREFETCHES[i].source);
+    }
+    mem_free(MEM_interning, PREFETCHES,
+             prefetches_capacity * sizeof(prefetch_t));
+    PREFETCHES = NULL;
+    prefetches_len = 0;
+    prefetches_capacity = 0;
+    prefetch_next = 0;
+    shepherd_unlock();
+}
+
+/* Ends the prefetch thread, after prefetch_drain, and waits until it no
+ * longer touches any state */
+void prefetch_stop()
+{
+    shepherd_lock();
+    prefetch_stopping = true;
+    shepherd_signal();
+    while (prefetch_running)
+        shepherd_wait();
+    prefetch_stopping = false;
+    shepherd_unlock();
+}
+#endif
+
+/* Loads the file at path into file map the first time it is probed, returns
+ * its file map index, or -1 if it cannot be read. */
+int file_probe(char *path, int *len_ref)
+{
+    int hash = hash_identifier(path);
+    path_entry_t *entry;
+    char *source;
+
+    if (path_cache_len * 4 >= path_cache_capacity * 3)
+        path_cache_grow();
+
+    entry = path_cache_slot(PATH_CACHE, path_cache_capacity, path, hash);
+
+    if (!entry->path) {
+#ifdef SHEPHERD_STATS
+        STATS.file_probes++;
+#endif
+        entry->path = mem_alloc(MEM_interning, strlen(path) + 1);
+        strcpy(entry->path, path);
+        entry->hash = hash;
+        entry->len = 0;
+        entry->prefetch = 0;
+        entry->file_idx = file_map_find(path);
+
+        /* A file mapped by other means, e.g. a snapshot, is not read again */
+        if (entry->file_idx != -1) {
+            entry->len = strlen(FILE_SOURCES[entry->file_idx]);
+        } else {
+            source = file_read(path, &entry->len);
+            if (source)
+                entry->file_idx = file_map_append(path, source, true);
+        }
+        path_cache_len++;
+    }
+#ifdef SHEPHERD_THREADS
+    else if (entry->prefetch)
+        prefetch_take(entry);
+#endif
+
+    len_ref[0] = entry->len;
+    return entry->file_idx;
+}
+
+/* Forgets every path probed, found or not, and every header loaded, so the
+ * next #include reads headers from disk again. Meant for a long-lived process
+ * between runs, once files may have been added or edited. Sources loaded so
+ * far stay mapped, as tokens and locations may still refer to them. */
+void lexer_reset_file_cache()
+{
+#ifdef SHEPHERD_THREADS
+    prefetch_drain();
+    prefetch_stop();
+#endif
+    for (int i = 0; i < path_cache_capacity; i++)
+        if (PATH_CACHE[i].path)
+            mem_free(MEM_interning, PATH_CACHE[i].path,
+                     strlen(PATH_CACHE[i].path) + 1);
+    mem_free(MEM_interning, PATH_CACHE,
+             path_cache_capacity * sizeof(path_entry_t));
+    PATH_CACHE = NULL;
+    path_cache_len = 0;
+    path_cache_capacity = 0;
+
+    /* Loaded files are no longer shared, a probe maps them anew */
+    for (int i = 0; i < file_map_capacity * 2; i++)
+        FILE_INDEX[i] = 0;
+
+    file_cache_epoch++;
+}
+
+/* Writes dir followed by name to path, returns false if it is too long */
+bool file_path_in(char *dir, int dir_len, char *name, char *path)
+{
+    if (dir_len + strlen(name) + 1 >= MAX_PATH_LEN)
+        return false;
+
+    strncpy(path, dir, dir_len);
+    path[dir_len] = '\0';
+    if (dir_len && dir[dir_len - 1] != '/')
+        strcpy(path + strlen(path), "/");
+    strcpy(path + strlen(path), name);
+    path_normalize(path);
+    return true;
+}
+
+/* Probes dir followed by name */
+int file_find_in(char *dir, int dir_len, char *name, int *len_ref)
+{
+    char path[MAX_PATH_LEN];
+
+    if (!file_path_in(dir, dir_len, name, path))
+        return -1;
+
+    return file_probe(path, len_ref);
+}
+
+/* Length of the directory part of file path, including its last slash */
+int file_dir_len(char *path)
+{
+    int len = strlen(path);
+
+    while (len && path[len - 1] != '/')
+        len--;
+    return len;
+}
+
+/* Resolves header name of #include, a quoted name is searched in the
+ * directory of the including file first, then every name in the include
+ * paths in order. Returns file map index of the header, loaded on first use,
+ * or -1 if it cannot be found. */
+int file_find_include(int includer_idx, char *name, bool quoted, int *len_ref)
+{
+    char *includer = FILE_NAMES[includer_idx];
+    int file_idx;
+
+    if (name[0] == '/')
+        return file_find_in("", 0, name, len_ref);
+
+    if (quoted) {
+        file_idx =
+            file_find_in(includer, file_dir_len(includer), name, len_ref);
+        if (file_idx != -1)
+            return file_idx;
+    }
+
+    for (int i = 0; i < include_paths_idx; i++) {
+        file_idx = file_find_in(INCLUDE_PATHS[i], strlen(INCLUDE_PATHS[i]),
+                                name, len_ref);
+        if (file_idx != -1)
+            return file_idx;
+    }
+
+    return -1;
+}
+
+#ifdef SHEPHERD_THREADS
+/* Queues every path file_find_include may probe for name, in the same order,
+ * up to one known to exist */
+void file_prefetch_include(int includer_idx, char *name, bool quoted)
+{
+    char path[MAX_PATH_LEN], *includer = FILE_NAMES[includer_idx];
+    bool first = true;
+
+    if (name[0] == '/') {
+        if (file_path_in("", 0, name, path))
+            prefetch_queue(path, &first);
+        return;
+    }
+
+    if (quoted && file_path_in(includer, file_dir_len(includer), name, path) &&
+        !prefetch_queue(path, &first))
+        return;
+
+    for (int i = 0; i < include_paths_idx; i++)
+        if (file_path_in(INCLUDE_PATHS[i], strlen(INCLUDE_PATHS[i]), name,
+                         path) &&
+            !prefetch_queue(path, &first))
+            return;
+}
+
+/* Queues the headers of every line-start #include of file_idx for the
+ * prefetch thread, which reads them while the lexer goes on; the lexer only
+ * waits for one it reaches while it is being read. Only raw lines are looked
+ * at, so headers of groups that are skipped later, or of directives inside
+ * comments, are read all the same. */
+void file_prefetch_includes(int file_idx)
+{
+    char name[MAX_PATH_LEN], close, *p = FILE_SOURCES[file_idx];
+    int len;
+
+    if (FILE_PREFETCHED[file_idx])
+        return;
+    FILE_PREFETCHED[file_idx] = true;
+
+    while (*p) {
+        while (*p == ' ' || *p == '\t')
+            p++;
+
+        if (*p == '#') {
+            p++;
+            while (*p == ' ' || *p == '\t')
+                p++;
+
+            if (!strncmp(p, "include", 7) && (p[7] == ' ' || p[7] == '\t' ||
+                                              p[7] == '"' || p[7] == '<')) {
+                p += 7;
+                while (*p == ' ' || *p == '\t')
+                    p++;
+
+                close = *p == '<' ? '>' : '"';
+                if (*p == '<' || *p == '"') {
+                    len = 0;
+                    for (p++; *p && *p != close && *p != '\n' &&
+                              len < MAX_PATH_LEN - 1;
+                         p++)
+                        name[len++] = *p;
+                    name[len] = '\0';
+
+                    if (*p == close) {
+#ifdef SHEPHERD_STATS
+                        STATS.include_prefetches++;
+#endif
+                        file_prefetch_include(file_idx, name, close == '"');
+                    }
+                }
+            }
+        }
+
+        while (*p && *p != '\n')
+            p++;
+        if (*p)
+            p++;
+    }
+}
+#endif
+
+int hash_identifier(char *name)
+{
+    int hash = HASH_SEED;
+
+    for (int i = 0; name[i]; i++)
+        hash = ((hash << 5) + hash + name[i]) & HASH_MASK;
+
+    return hash;
+}
+
+void add_keyword(char *name, token_type_t typ)
+{
+    keyword_t *keyword = &KEYWORDS[keywords_idx++];
+    int slot;
+
+    keyword->name = name;
+    keyword->hash = hash_identifier(name);
+    keyword->typ = typ;
+
+    slot = keyword->hash & (KEYWORD_BUCKETS_SIZE - 1);
+    while (KEYWORD_BUCKETS[slot])
+        slot = (slot + 1) & (KEYWORD_BUCKETS_SIZE - 1);
+    KEYWORD_BUCKETS[slot] = keywords_idx;
+}
+
+/* Classifies identifier of len bytes at name by its precomputed hash,
+ * spelling is only compared once hashes match. name needs no terminator, so
+ * it can point into source. */
+token_type_t find_keyword(char *name, int len, int hash)
+{
+    int slot = hash & (KEYWORD_BUCKETS_SIZE - 1);
+
+    while (KEYWORD_BUCKETS[slot]) {
+        keyword_t *keyword = &KEYWORDS[KEYWORD_BUCKETS[slot] - 1];
+
+        if (keyword->hash == hash && !strncmp(name, keyword->name, len) &&
+            !keyword->name[len])
+            return keyword->typ;
+
+        slot = (slot + 1) & (KEYWORD_BUCKETS_SIZE - 1);
+    }
+
+    return T_identifier;
+}
+
+/* Sets literal of token to the first token->len bytes at spelling */
+void token_spell(token_t *token, char *spelling)
+{
+    int len = token->len;
+
+    if (len > MAX_TOKEN_LEN - 1)
+        len = MAX_TOKEN_LEN - 1;
+    memcpy(token->literal, spelling, len);
+    token->literal[len] = '\0';
+}
+
+char *token_string(token_t *token);
+
+/* Spelling of token. Tokens of a kinds-only lexer only record where it is in
+ * their source, it is copied out on first use and stays valid as long as the
+ * source is not edited. Literals of T_string and T_char are their contents
+ * and value then. */
+char *token_literal(token_t *token)
+{
+    int len;
+
+    if (token->literal[0])
+        return token->literal;
+
+    if (token->typ == T_string) {
+        len = token->str_len;
+        if (len > MAX_TOKEN_LEN - 1)
+            len = MAX_TOKEN_LEN - 1;
+        memcpy(token->literal, token_string(token), len);
+        token->literal[len] = '\0';
+    } else if (token->typ == T_char) {
+        token->literal[0] = token->value;
+        token->literal[1] = '\0';
+    } else if (token->len)
+        token_spell(token,
+                    FILE_SOURCES[token->loc.file_idx] + token->loc.offset);
+    return token->literal;
+}
+
+void symbol_grow()
+{
+    int capacity = symbols_capacity ? symbols_capacity * 2 : SYMBOL_TABLE_SIZE;
+    symbol_t *symbols = mem_alloc(MEM_interning, capacity * sizeof(symbol_t));
+    int *buckets = mem_calloc(MEM_interning, capacity * 2 * sizeof(int));
+    int mask = capacity * 2 - 1;
+
+    for (int i = 0; i < symbols_len; i++) {
+        int slot = SYMBOLS[i].hash & mask;
+
+        while (buckets[slot])
+            slot = (slot + 1) & mask;
+        buckets[slot] = i + 1;
+    }
+
+    if (symbols_len)
+        memcpy(symbols, SYMBOLS, symbols_len * sizeof(symbol_t));
+#ifdef SHEPHERD_THREADS
+    /* Consumer of a pipelined lexer reads names meanwhile, see symbol_name */
+    shepherd_lock();
+#endif
+    mem_free(MEM_interning, SYMBOLS, symbols_capacity * sizeof(symbol_t));
+    SYMBOLS = symbols;
+#ifdef SHEPHERD_THREADS
+    shepherd_unlock();
+#endif
+    mem_free(MEM_interning, SYMBOL_BUCKETS,
+             symbols_capacity * 2 * sizeof(int));
+    SYMBOL_BUCKETS = buckets;
+    symbols_capacity = capacity;
+}
+
+/* Copies len bytes at name into symbol name storage */
+char *symbol_store(char *name, int len)
+{
+    string_chunk_t *chunk = SYMBOL_CHUNKS;
+    char *data;
+
+    if (!chunk || chunk->size + len + 1 > chunk->capacity) {
+        int capacity = SYMBOL_CHUNK_SIZE;
+
+        if (capacity < len + 1)
+            capacity = len + 1;
+
+        chunk = mem_alloc(MEM_interning, sizeof(string_chunk_t));
+        chunk->data = mem_alloc(MEM_interning, capacity);
+        chunk->capacity = capacity;
+        chunk->size = 0;
+        chunk->next = SYMBOL_CHUNKS;
+        SYMBOL_CHUNKS = chunk;
+    }
+
+    data = chunk->data + chunk->size;
+    memcpy(data, name, len);
+    data[len] = '\0';
+    chunk->size += len + 1;
+    return data;
+}
+
+/* Returns symbol id of the identifier of len bytes at name, hashed as by
+ * hash_identifier, and stores its spelling the first time it is seen. name
+ * needs no terminator, so it can point into source. */
+int symbol_intern(char *name, int len, int hash)
+{
+    int mask, slot;
+    symbol_t *symbol;
+
+    if (symbols_len == symbols_capacity)
+        symbol_grow();
+
+    mask = symbols_capacity * 2 - 1;
+    slot = hash & mask;
+
+    while (SYMBOL_BUCKETS[slot]) {
+        symbol = &SYMBOLS[SYMBOL_BUCKETS[slot] - 1];
+
+        if (symbol->hash == hash && symbol->len == len &&
+            !memcmp(symbol->name, name, len))
+            return SYMBOL_BUCKETS[slot] - 1;
+
+        slot = (slot + 1) & mask;
+    }
+
+    symbol = &SYMBOLS[symbols_len];
+    symbol->name = symbol_store(name, len);
+    symbol->len = len;
+    symbol->hash = hash;
+    SYMBOL_BUCKETS[slot] = ++symbols_len;
+    return symbols_len - 1;
+}
+
+/* Spelling of symbol id, lives until free_globals. Safe to call from the
+ * consumer of a pipelined lexer, while its producer thread interns more. */
+char *symbol_name(int symbol)
+{
+    char *name;
+
+#ifdef SHEPHERD_THREADS
+    shepherd_lock();
+#endif
+    name = SYMBOLS[symbol].name;
+#ifdef SHEPHERD_THREADS
+    shepherd_unlock();
+#endif
+    return name;
+}
+
+int symbol_hash(int symbol)
+{
+    return SYMBOLS[symbol].hash;
+}
+
+/* Number of symbols interned so far, ids are below it */
+int symbol_count()
+{
+    return symbols_len;
+}
+
+/* Reserves len bytes of string storage */
+char *string_alloc(int len)
+{
+    string_chunk_t *chunk = STRING_CHUNKS;
+    char *data;
+
+    if (!chunk || chunk->size + len > chunk->capacity) {
+        int capacity = STRING_CHUNK_SIZE;
+
+        if (capacity < len)
+            capacity = len;
+
+        chunk = mem_alloc(MEM_strings, sizeof(string_chunk_t));
+        chunk->data = mem_alloc(MEM_strings, capacity);
+        chunk->capacity = capacity;
+        chunk->size = 0;
+        chunk->next = STRING_CHUNKS;
+        STRING_CHUNKS = chunk;
+    }
+
+    data = chunk->data + chunk->size;
+    chunk->size += len;
+    return data;
+}
+
+void string_decode(char *raw, int raw_len, char *str);
+
+/* Contents of T_string token, token->str_len bytes long. Escaped contents
+ * scanned by a kinds-only lexer are decoded on first use, from the len raw
+ * bytes after the opening quote. */
+char *token_string(token_t *token)
+{
+    char *raw;
+
+    if (token->str)
+        return token->str;
+
+    raw = FILE_SOURCES[token->loc.file_idx] + token->loc.offset + 1;
+    if (!token->len)
+        return raw;
+
+    token->str = string_alloc(token->str_len);
+    string_decode(raw, token->len, token->str);
+    return token->str;
+}
+
+/* Moves contents of T_string token read in place to string storage, so they
+ * stay valid after its source is edited */
+void token_string_detach(token_t *token)
+{
+    char *str;
+
+    if (token->str)
+        return;
+
+    str = string_alloc(token->str_len);
+    memcpy(str, token_string(token), token->str_len);
+    token->str = str;
+}
+
+/* Number of adjacent T_string tokens that tokens starts with, out of len. A
+ * run ending a batch of lexer_run that has no T_eof may go on in the next
+ * one, a sink joining it asks for TS_lookahead then. */
+int string_run(token_t *tokens, int len)
+{
+    int run = 0;
+
+    while (run < len && tokens[run].typ == T_string)
+        run++;
+    return run;
+}
+
+/* Contents of len adjacent T_string tokens joined into one, as translation
+ * phase 6 does, and their length in len_ref. Nothing is copied for a single
+ * literal, so joining is only paid for by callers that need it. */
+char *string_concat(token_t *tokens, int len, int *len_ref)
+{
+    char *str;
+    int total = 0;
+
+    if (len == 1) {
+        len_ref[0] = tokens[0].str_len;
+        return token_string(&tokens[0]);
+    }
+
+    for (int i = 0; i < len; i++)
+        total += tokens[i].str_len;
+
+    str = string_alloc(total);
+    total = 0;
+    for (int i = 0; i < len; i++) {
+        memcpy(str + total, token_string(&tokens[i]), tokens[i].str_len);
+        total += tokens[i].str_len;
+    }
+
+    len_ref[0] = total;
+    return str;
+}
+
+/* Appends a copy of token to the macro token array starting at body, which
+ * already holds len tokens. The array under construction always sits at the
+ * tail of the newest chunk, so when it outgrows that chunk it is moved to a
+ * fresh one as a whole. Returns the (possibly moved) start of the array. */
+token_t *macro_tokens_append(token_t *body, int len, token_t *token)
+{
+    macro_chunk_t *chunk = MACRO_CHUNKS;
+
+    if (!chunk || chunk->size >= chunk->capacity) {
+        macro_chunk_t *fresh = mem_alloc(MEM_macros, sizeof(macro_chunk_t));
+        int capacity = MACRO_CHUNK_SIZE;
+
+        if (capacity < (len + 1) * 2)
+            capacity = (len + 1) * 2;
+
+        fresh->data = mem_alloc(MEM_macros, capacity * sizeof(token_t));
+        fresh->capacity = capacity;
+#ifdef SHEPHERD_STATS
+        STATS.macro_chunks++;
+        STATS.macro_tokens += capacity;
+#endif
+        fresh->size = len;
+        fresh->next = chunk;
+
+        if (len) {
+            memcpy(fresh->data, body, len * sizeof(token_t));
+            chunk->size -= len;
+        }
+
+        MACRO_CHUNKS = fresh;
+        chunk = fresh;
+        body = fresh->data;
+    }
+
+    if (!len)
+        body = &chunk->data[chunk->size];
+
+    memcpy(&chunk->data[chunk->size], token, sizeof(token_t));
+    chunk->data[chunk->size].next = NULL;
+    if (token->typ == T_string)
+        token_string_detach(&chunk->data[chunk->size]);
+    chunk->size++;
+    return body;
+}
+
+macro_table_t *macro_table_init()
+{
+    return mem_calloc(MEM_macros, sizeof(macro_table_t));
+}
+
+/* Forks table in constant time, both tables share every page until either
+ * side writes to it. */
+macro_table_t *macro_table_fork(macro_table_t *table)
+{
+    macro_table_t *fork = mem_alloc(MEM_macros, sizeof(macro_table_t));
+
+    memcpy(fork, table, sizeof(macro_table_t));
+
+    if (fork->dir)
+        fork->dir->refs++;
+
+    for (int i = 0; i < MACRO_BUCKET_PAGES; i++)
+        if (fork->buckets[i])
+            fork->buckets[i]->refs++;
+
+    return fork;
+}
+
+void macro_dir_free(macro_dir_t *dir)
+{
+    for (int i = 0; i < dir->capacity; i++)
+        if (dir->pages[i] && !--dir->pages[i]->refs)
+            mem_free(MEM_macros, dir->pages[i], sizeof(macro_page_t));
+
+    mem_free(MEM_macros, dir->pages, dir->capacity * sizeof(macro_page_t *));
+    mem_free(MEM_macros, dir, sizeof(macro_dir_t));
+}
+
+void macro_table_free(macro_table_t *table)
+{
+    if (table->dir && !--table->dir->refs)
+        macro_dir_free(table->dir);
+
+    for (int i = 0; i < MACRO_BUCKET_PAGES; i++)
+        if (table->buckets[i] && !--table->buckets[i]->refs)
+            mem_free(MEM_macros, table->buckets[i],
+                     sizeof(macro_bucket_page_t));
+
+    mem_free(MEM_macros, table, sizeof(macro_table_t));
+}
+
+/* Read-only access to entry idx, the entry may be shared with other tables */
+macro_t *macro_table_get(macro_table_t *table, int idx)
+{
+    return &table->dir->pages[idx / MACRO_PAGE_SIZE]
+                ->macros[idx % MACRO_PAGE_SIZE];
+}
+
+/* Whether two tables hold the same macros, pages still shared between them
+ * are not looked into. Generations are not compared, a macro defined again to
+ * the same replacement list is the same. */
+bool macro_table_equal(macro_table_t *a, macro_table_t *b)
+{
+    if (a->len != b->len)
+        return false;
+
+    if (a->dir == b->dir)
+        return true;
+
+    for (int i = 0; i < a->len; i++) {
+        macro_t *x, *y;
+
+        if (a->dir->pages[i / MACRO_PAGE_SIZE] ==
+            b->dir->pages[i / MACRO_PAGE_SIZE]) {
+            i += MACRO_PAGE_SIZE - 1 - i % MACRO_PAGE_SIZE;
+            continue;
+        }
+
+        x = macro_table_get(a, i);
+        y = macro_table_get(b, i);
+
+        if (x->defined != y->defined ||
+            x->functiono_like != y->functiono_like ||
+            x->replacement_len != y->replacement_len)
+            return false;
+
+        if (x->name == y->name)
+            continue;
+
+        for (int j = 0; j <= x->replacement_len; j++)
+            if (x->name[j].flags != y->name[j].flags ||
+                strcmp(x->name[j].literal, y->name[j].literal))
+                return false;
+    }
+
+    return true;
+}
+
+/* Makes the page directory of table its own, with room for page, copying it
+ * if it is shared and doubling it if it is too small */
+macro_dir_t *macro_table_own_dir(macro_table_t *table, int page)
+{
+    macro_dir_t *dir = table->dir, *copy;
+    int capacity = dir ? dir->capacity : MACRO_PAGES;
+
+    if (dir && dir->refs == 1 && page < dir->capacity)
+        return dir;
+
+    while (capacity <= page)
+        capacity *= 2;
+
+    copy = mem_alloc(MEM_macros, sizeof(macro_dir_t));
+    copy->refs = 1;
+    copy->capacity = capacity;
+    copy->pages = mem_calloc(MEM_macros, capacity * sizeof(macro_page_t *));
+
+    if (dir) {
+        for (int i = 0; i < dir->capacity; i++) {
+            copy->pages[i] = dir->pages[i];
+            /* A shared directory keeps referencing its pages */
+            if (dir->refs > 1 && dir->pages[i])
+                dir->pages[i]->refs++;
+        }
+
+        if (dir->refs > 1)
+            dir->refs--;
+        else {
+            mem_free(MEM_macros, dir->pages,
+                     dir->capacity * sizeof(macro_page_t *));
+            mem_free(MEM_macros, dir, sizeof(macro_dir_t));
+        }
+    }
+
+    table->dir = copy;
+    return copy;
+}
+
+/* Writable access to entry idx, copies its page and the page directory first
+ * if they are shared */
+macro_t *macro_table_write(macro_table_t *table, int idx)
+{
+    macro_dir_t *dir = macro_table_own_dir(table, idx / MACRO_PAGE_SIZE);
+    macro_page_t *page = dir->pages[idx / MACRO_PAGE_SIZE];
+
+    if (!page) {
+        page = mem_alloc(MEM_macros, sizeof(macro_page_t));
+        page->refs = 1;
+        dir->pages[idx / MACRO_PAGE_SIZE] = page;
+    } else if (page->refs > 1) {
+        macro_page_t *copy = mem_alloc(MEM_macros, sizeof(macro_page_t));
+
+        memcpy(copy, page, sizeof(macro_page_t));
+        copy->refs = 1;
+        page->refs--;
+        dir->pages[idx / MACRO_PAGE_SIZE] = copy;
+        page = copy;
+    }
+
+    return &page->macros[idx % MACRO_PAGE_SIZE];
+}
+
+int macro_table_bucket(macro_table_t *table, int hash)
+{
+    int bucket = hash & (MACRO_BUCKETS_SIZE - 1);
+    macro_bucket_page_t *page = table->buckets[bucket / MACRO_PAGE_SIZE];
+
+    return page ? page->heads[bucket % MACRO_PAGE_SIZE] : -1;
+}
+
+void macro_table_set_bucket(macro_table_t *table, int hash, int idx)
+{
+    int bucket = hash & (MACRO_BUCKETS_SIZE - 1);
+    macro_bucket_page_t *page = table->buckets[bucket / MACRO_PAGE_SIZE];
+
+    if (!page || page->refs > 1) {
+        macro_bucket_page_t *copy =
+            mem_alloc(MEM_macros, sizeof(macro_bucket_page_t));
+
+        for (int i = 0; i < MACRO_PAGE_SIZE; i++)
+            copy->heads[i] = page ? page->heads[i] : -1;
+        copy->refs = 1;
+
+        if (page)
+            page->refs--;
+        table->buckets[bucket / MACRO_PAGE_SIZE] = copy;
+        page = copy;
+    }
+
+    page->heads[bucket % MACRO_PAGE_SIZE] = idx;
+}
+
+/* Index of the table entry of the name with symbol id and hash, -1 if there
+ * is none */
+int macro_table_find(macro_table_t *table, int symbol, int hash)
+{
+    int idx = macro_table_bucket(table, hash);
+
+    while (idx != -1) {
+        macro_t *macro = macro_table_get(table, idx);
+
+        if (macro->symbol == symbol)
+            return idx;
+
+        idx = macro->bucket_next;
+    }
+
+    return -1;
+}
+
+/* Returns index of the table entry of name whether it is currently defined or
+ * not, -1 if there is none. Every distinct name owns exactly one entry, which
+ * is created on demand if create is true, so its generation can be tracked
+ * across #define and #undef. */
+int lookup_macro(macro_table_t *table, token_t *name, bool create)
+{
+    int idx = macro_table_find(table, name->symbol, name->hash);
+    macro_t *macro;
+
+    if (idx != -1 || !create)
+        return idx;
+
+    idx = table->len++;
+    macro = macro_table_write(table, idx);
+    /* Left to define_macro, which copies it to head the body */
+    macro->name = NULL;
+    macro->replacement = NULL;
+    macro->replacement_len = 0;
+    macro->functiono_like = false;
     macro->disabled = false;
+    macro->defined = false;
+    macro->generation = 0;
+    macro->symbol = name->symbol;
+    macro->hash = name->hash;
+    macro->bucket_next = macro_table_bucket(table, name->hash);
+    macro_table_set_bucket(table, name->hash, idx);
+
+    return idx;
+}
+
+/* (Re)defines macro named after name token, replacing any previous
+ * definition in place. */
+macro_t *define_macro(macro_table_t *table, token_t *name, bool function_like) {
+    macro_t *macro =
+        macro_table_write(table, lookup_macro(table, name, true));
+
+    /* Name is copied so it heads the new body in the macro arena */
+    macro->name = macro_tokens_append(NULL, 0, name);
+    macro->replacement = NULL;
+    macro->replacement_len = 0;
+    macro->functiono_like = function_like;
+    macro->defined = true;
+    macro->generation = ++macro_generation;
     return macro;
 }
 
-macro_t *find_macro(char *name) {
-    if (!name)
+void undef_macro(macro_table_t *table, token_t *name) {
+    int idx = lookup_macro(table, name, false);
+    macro_t *macro;
+
+    if (idx == -1 || !macro_table_get(table, idx)->defined)
+        return;
+
+    macro = macro_table_write(table, idx);
+    macro->defined = false;
+    macro->generation = ++macro_generation;
+}
+
+macro_t *find_macro(macro_table_t *table, token_t *name) {
+    int idx = lookup_macro(table, name, false);
+    macro_t *macro;
+
+#ifdef SHEPHERD_STATS
+    STATS.find_macro_calls++;
+#endif
+
+    if (idx == -1)
         return NULL;
 
-    for (int i = 0; i < macros_idx; i++) {
-        macro_t *macro = &MACROS[i];
+    macro = macro_table_get(table, idx);
+    if (!macro->defined || macro->disabled)
+        return NULL;
 
-        if (!macro->disabled && !strcmp(name, macro->name->literal))
-            return macro;
-    }
+#ifdef SHEPHERD_STATS
+    STATS.find_macro_hits++;
+#endif
 
-    return NULL;
+    return macro;
 }
 
 void init_globals() {
-    MACROS = malloc(MAX_MACROS * sizeof(macro_t));
+    MACRO_CHUNKS = NULL;
+    STRING_CHUNKS = NULL;
+    DIAGNOSTICS = NULL;
+    FILE_NAMES = NULL;
+    FILE_SOURCES = NULL;
+    FILE_PREFETCHED = NULL;
+    FILE_INDEX = NULL;
+    PATH_CACHE = NULL;
+    path_cache_len = 0;
+    path_cache_capacity = 0;
+    SYMBOLS = NULL;
+    SYMBOL_BUCKETS = NULL;
+    SYMBOL_CHUNKS = NULL;
+    symbols_len = 0;
+    symbols_capacity = 0;
+
+    for (int i = 0; i < KEYWORD_BUCKETS_SIZE; i++)
+        KEYWORD_BUCKETS[i] = 0;
+
+    add_keyword("if", T_if);
+    add_keyword("while", T_while);
+    add_keyword("for", T_for);
+    add_keyword("do", T_do);
+    add_keyword("else", T_else);
+    add_keyword("return", T_return);
+    add_keyword("typedef", T_typedef);
+    add_keyword("enum", T_enum);
+    add_keyword("struct", T_struct);
+    add_keyword("sizeof", T_sizeof);
+    add_keyword("switch", T_switch);
+    add_keyword("case", T_case);
+    add_keyword("break", T_break);
+    add_keyword("default", T_default);
+    add_keyword("continue", T_continue);
 }
 
 void free_globals() {
-    free(MACROS);
+    while (MACRO_CHUNKS) {
+        macro_chunk_t *next = MACRO_CHUNKS->next;
+        mem_free(MEM_macros, MACRO_CHUNKS->data,
+                 MACRO_CHUNKS->capacity * sizeof(token_t));
+        mem_free(MEM_macros, MACRO_CHUNKS, sizeof(macro_chunk_t));
+        MACRO_CHUNKS = next;
+    }
+
+    while (STRING_CHUNKS) {
+        string_chunk_t *next = STRING_CHUNKS->next;
+        mem_free(MEM_strings, STRING_CHUNKS->data, STRING_CHUNKS->capacity);
+        mem_free(MEM_strings, STRING_CHUNKS, sizeof(string_chunk_t));
+        STRING_CHUNKS = next;
+    }
+
+    while (SYMBOL_CHUNKS) {
+        string_chunk_t *next = SYMBOL_CHUNKS->next;
+        mem_free(MEM_interning, SYMBOL_CHUNKS->data, SYMBOL_CHUNKS->capacity);
+        mem_free(MEM_interning, SYMBOL_CHUNKS, sizeof(string_chunk_t));
+        SYMBOL_CHUNKS = next;
+    }
+    mem_free(MEM_interning, SYMBOLS, symbols_capacity * sizeof(symbol_t));
+    mem_free(MEM_interning, SYMBOL_BUCKETS,
+             symbols_capacity * 2 * sizeof(int));
+
+#ifdef SHEPHERD_THREADS
+    prefetch_drain();
+    prefetch_stop();
+#endif
+    for (int i = 0; i < path_cache_capacity; i++)
+        if (PATH_CACHE[i].path)
+            mem_free(MEM_interning, PATH_CACHE[i].path,
+                     strlen(PATH_CACHE[i].path) + 1);
+    mem_free(MEM_interning, PATH_CACHE,
+             path_cache_capacity * sizeof(path_entry_t));
 
     for (int i = 0; i < file_map_idx; i++) {
         free(FILE_NAMES[i]);
-        free(FILE_SOURCES[i]);
+        file_source_free(FILE_SOURCES[i]);
+    }
+    mem_free(MEM_sources, FILE_NAMES, file_map_capacity * sizeof(char *));
+    mem_free(MEM_sources, FILE_SOURCES, file_map_capacity * sizeof(char *));
+    mem_free(MEM_sources, FILE_PREFETCHED, file_map_capacity * sizeof(bool));
+    mem_free(MEM_sources, FILE_INDEX, file_map_capacity * 2 * sizeof(int));
+}
+
+/* Prints message with its location and the source line it points at */
+void diagnostic_print(char *message, location_t *location)
+{
+    char line[MAX_LINE_LEN], *source = FILE_SOURCES[location->file_idx];
+    int start_pos = 0, len = 0;
+
+    printf("[%s:%d:%d] Error: %s\n", FILE_NAMES[location->file_idx],
+           location->line, location->col, message);
+
+    for (int line_num = 1; line_num < location->line; line_num++) {
+        while (source[start_pos] && source[start_pos] != '\n')
+            start_pos++;
+        if (source[start_pos])
+            start_pos++;
+    }
+    while (source[start_pos + len] && source[start_pos + len] != '\n' &&
+           len < MAX_LINE_LEN - 2)
+        len++;
+    strncpy(line, source + start_pos, len);
+    line[len] = '\0';
+    printf("%s\n", line);
+    for (len = 0; len < location->col - 1 && len < MAX_LINE_LEN - 2; len++)
+        line[len] = ' ';
+    line[len] = '^';
+    line[len + 1] = '\0';
+    printf("%s\n", line);
+}
+
+void diagnostics_record(diagnostics_t *diags, char *message, location_t *loc)
+{
+    diagnostic_t *diag;
+
+    if (diags->limit && diags->len >= diags->limit)
+        return;
+
+    if (diags->len == diags->capacity) {
+        diagnostic_t *items;
+
+        diags->capacity = diags->capacity * 2 + 16;
+        items = malloc(diags->capacity * sizeof(diagnostic_t));
+        if (diags->len)
+            memcpy(items, diags->items, diags->len * sizeof(diagnostic_t));
+        free(diags->items);
+        diags->items = items;
     }
+
+    diag = &diags->items[diags->len++];
+    strncpy(diag->message, message, DIAG_MSG_LEN - 1);
+    diag->message[DIAG_MSG_LEN - 1] = '\0';
+    memcpy(&diag->loc, loc, sizeof(location_t));
 }
 
 /* produces an error message with location information then exits abnormally,
- * location is optional. */
+ * location is optional. If a lexer context collects diagnostics, an error
+ * with location is recorded there instead and returns, its caller recovers.
+ * Errors without location are internal and always fatal. */
 void error(char *str, location_t *location, ...)
 {
-    /* sprintf logic copied from c.c, no boundary check included */
-    char ERR_MSG_BUF[100];
+    /* sprintf logic copied from c.c. Strings, e.g. long include names, are
+     * cut to the space left, and formatting stops while a number still fits. */
+    char ERR_MSG_BUF[MAX_LINE_LEN];
     int *var_args = &str + 8;
-    int si = 0, bi = 0, pi = 0;
+    int si = 0, bi = 0, pi = 0, len;
 
-    while (str[si]) {
+    while (str[si] && bi < MAX_LINE_LEN - 32) {
         if (str[si] != '%') {
             ERR_MSG_BUF[bi] = str[si];
             bi++;
@@ -118,8 +1675,11 @@ void error(char *str, location_t *location, ...)
                 ERR_MSG_BUF[bi++] = var_args[pi];
                 break;
             case 115: /* s */
-                strcpy(ERR_MSG_BUF + bi, var_args[pi]);
-                bi += strlen(var_args[pi]);
+                len = strlen(var_args[pi]);
+                if (len > MAX_LINE_LEN - 1 - bi)
+                    len = MAX_LINE_LEN - 1 - bi;
+                strncpy(ERR_MSG_BUF + bi, var_args[pi], len);
+                bi += len;
                 break;
             case 111: /* o */
                 bi += __format(ERR_MSG_BUF + bi, var_args[pi], w, zp, 8, pp);
@@ -145,27 +1705,11 @@ void error(char *str, location_t *location, ...)
         exit(1);
     }
 
-    printf("[%s:%d:%d] Error: %s\n", FILE_NAMES[location->file_idx],
-           location->line, location->col, ERR_MSG_BUF);
-
-    char line[MAX_LINE_LEN], *source = FILE_SOURCES[location->file_idx];
-    int start_pos = 0, len = 0;
-
-    for (int line_num = 1; line_num < location->line; line_num++) {
-        while (source[start_pos] != '\n')
-            start_pos++;
-        start_pos++;
+    if (DIAGNOSTICS) {
+        diagnostics_record(DIAGNOSTICS, ERR_MSG_BUF, location);
+        return;
     }
-    while (source[start_pos + len] != '\n')
-        len++;
-    strncpy(line, source + start_pos, len);
-    line[len] = '\0';
-    printf("%s\n", line);
-    for (len = 0; len < location->col - 1; len++)
-        line[len] = ' ';
-    line[len] = '^';
-    line[len + 1] = '\0';
-    printf("%s\n", line);
 
+    diagnostic_print(ERR_MSG_BUF, location);
     exit(1);
 }
@@ -13,19 +13,28 @@ typedef struct {
 
 token_arena_t *arena_init(int capacity)
 {
-    token_arena_t *arena = malloc(sizeof(token_arena_t));
+    token_arena_t *arena = mem_alloc(MEM_arena, sizeof(token_arena_t));
     arena->capacity = capacity;
     arena->size = 0;
-    arena->data = malloc(capacity * sizeof(token_t));
+    arena->data = mem_alloc(MEM_arena, capacity * sizeof(token_t));
+#ifdef SHEPHERD_STATS
+    STATS.arena_chunks++;
+    STATS.arena_tokens += capacity;
+#endif
     return arena;
 }
 
+/* Token arena only holds transient tokens, each regional lexer refers to its
+ * current token at most, while macro bodies are kept in their own storage, so
+ * a full arena is simply recycled from the start. */
 token_t *alloc_token(token_arena_t *arena, int size)
 {
-    /* TODO: Expand arena if remaining capacity is not enough */
-    if (arena->size + size > arena->capacity)
+    if (size > arena->capacity)
         return NULL;
 
+    if (arena->size + size > arena->capacity)
+        arena->size = 0;
+
     token_t *data = &arena->data[arena->size], *cur = data;
     for (int i = 1; i < size; i++) {
         cur->next = &arena->data[arena->size + i];
@@ -50,19 +59,27 @@ void arena_free(token_arena_t *arena)
 {
     if (!arena)
         return;
-    if (arena->data)
-        free(arena->data);
-    free(arena);
+    mem_free(MEM_arena, arena->data, arena->capacity * sizeof(token_t));
+    mem_free(MEM_arena, arena, sizeof(token_arena_t));
 }
 
 typedef enum { LM_source, LM_token } lexer_mode_t;
 
+/* State of an open #if, #ifdef or #ifndef */
+typedef struct {
+    /* true once any group of the conditional has been taken */
+    bool taken;
+    bool seen_else;
+    location_t loc;
+} cond_frame_t;
+
 typedef struct {
     token_arena_t *arena;
     int file_idx;
     lexer_mode_t mode;
-    /* LM_Source specific members */
-    char source[MAX_SOURCE];
+    /* LM_Source specific members, source is the buffer of file_idx in file
+     * map, not a copy */
+    char *source;
     int source_len;
     int pos;
     int line;
@@ -70,8 +87,20 @@ typedef struct {
     token_t *cur_token;
     bool after_newline;
     bool inside_macro;
-    /* LM_Token specific members */
-    token_t *tokens_head;
+    /* Tokens outside directives only record their kind, offset and length,
+     * see lexer_set_kinds_only */
+    bool kinds_only;
+    /* TK_* flags of the token being scanned */
+    int token_flags;
+    cond_frame_t conds[MAX_COND_DEPTH];
+    int conds_len;
+    /* Whether a trace span is open for the lexer's lifetime */
+    bool traced;
+    /* LM_Token specific members, tokens is an immutable array replayed by
+     * index */
+    token_t *tokens;
+    int tokens_len;
+    int tokens_pos;
 } regional_lexer_t;
 
 void reg_lexer_next_token(regional_lexer_t *lexer);
@@ -81,11 +110,15 @@ regional_lexer_t *reg_lexer_source_init(token_arena_t *arena,
                                         int source_len,
                                         int file_idx)
 {
-    regional_lexer_t *lexer = malloc(sizeof(regional_lexer_t));
+    regional_lexer_t *lexer =
+        mem_alloc(MEM_reg_lexers, sizeof(regional_lexer_t));
+#ifdef SHEPHERD_STATS
+    STATS.reg_lexers++;
+#endif
     lexer->arena = arena;
     lexer->file_idx = file_idx;
     lexer->mode = LM_source;
-    strcpy(lexer->source, source);
+    lexer->source = source;
     lexer->source_len = source_len;
     lexer->pos = 0;
     lexer->line = 1;
@@ -93,18 +126,33 @@ regional_lexer_t *reg_lexer_source_init(token_arena_t *arena,
     lexer->cur_token = NULL;
     lexer->after_newline = true;
     lexer->inside_macro = false;
+    lexer->kinds_only = false;
+    lexer->token_flags = 0;
+    lexer->conds_len = 0;
+    lexer->traced = TRACE != NULL;
+    trace_begin(TRACE_FILE, "", FILE_NAMES[file_idx]);
     return lexer;
 }
 
 regional_lexer_t *reg_lexer_token_init(token_arena_t *arena,
-                                       token_t *tokens_head,
+                                       token_t *tokens,
+                                       int tokens_len,
                                        int file_idx)
 {
-    regional_lexer_t *lexer = malloc(sizeof(regional_lexer_t));
+    regional_lexer_t *lexer =
+        mem_alloc(MEM_reg_lexers, sizeof(regional_lexer_t));
+#ifdef SHEPHERD_STATS
+    STATS.reg_lexers++;
+#endif
     lexer->arena = arena;
     lexer->file_idx = file_idx;
     lexer->mode = LM_token;
-    lexer->tokens_head = tokens_head;
+    lexer->cur_token = NULL;
+    lexer->conds_len = 0;
+    lexer->traced = false;
+    lexer->tokens = tokens;
+    lexer->tokens_len = tokens_len;
+    lexer->tokens_pos = 0;
     return lexer;
 }
 
@@ -144,24 +192,230 @@ bool is_identifier(char ch)
     return is_alnum(ch) || ch == '_';
 }
 
-/* Copies location data to loc_ref, allocates location_t on heap if loc_ref is
- * NULL */
-location_t *reg_lexer_cur_loc(regional_lexer_t *lexer, location_t *loc_ref)
+/* Length of the backslash-newline (line splice) at str, 0 if there is none.
+ * Like gcc, blanks between the backslash and the newline still splice. */
+int splice_len(char *str)
+{
+    int len = 1;
+
+    if (str[0] != '\\')
+        return 0;
+    while (is_white_space(str[len]))
+        len++;
+    if (!is_newline(str[len]))
+        return 0;
+    return str[len] == '\r' && str[len + 1] == '\n' ? len + 2 : len + 1;
+}
+
+/* Value of ch as a digit in base, -1 if it is none */
+int numeric_digit(char ch, int base)
+{
+    int digit = 16;
+
+    if (is_digit(ch))
+        digit = ch - '0';
+    else if (ch >= 'a' && ch <= 'f')
+        digit = ch - 'a' + 10;
+    else if (ch >= 'A' && ch <= 'F')
+        digit = ch - 'A' + 10;
+
+    return digit < base ? digit : -1;
+}
+
+bool is_exponent(char ch, int base)
+{
+    if (base == 16)
+        return ch == 'p' || ch == 'P';
+    return ch == 'e' || ch == 'E';
+}
+
+/* Converts the decimal digits at str, up to end, into value_ref and returns
+ * their count. Whole words of 4 digits are checked and converted in a few
+ * word operations (SWAR), the first digit sits in the lowest byte. */
+int numeric_decimal(char *str, int end, int *value_ref)
+{
+    int value = 0, pos = 0, word;
+
+    while (pos + 4 <= end) {
+        word = (str[pos] & 255) | (str[pos + 1] & 255) << 8 |
+               (str[pos + 2] & 255) << 16 | (str[pos + 3] & 255) << 24;
+
+        /* Every byte is within '0'..'9' */
+        if ((word & 0xf0f0f0f0) != 0x30303030 ||
+            ((word + 0x06060606) & 0xf0f0f0f0) != 0x30303030)
+            break;
+
+        word -= 0x30303030;
+        word = (word * 10 + (word >> 8)) & 0x00ff00ff;
+        word = (word * 100 + (word >> 16)) & 0xffff;
+        value = value * 10000 + word;
+        pos += 4;
+    }
+
+    while (pos < end && is_digit(str[pos]))
+        value = value * 10 + str[pos++] - '0';
+
+    value_ref[0] = value;
+    return pos;
+}
+
+/* Truncated value of the floating literal at str, mantissa digits of base
+ * start at pos. Digits past what an int holds only scale the result. */
+int numeric_float(char *str, int pos, int base, int *pos_ref)
+{
+    int mantissa = 0, scale = 0, exp = 0, digit, radix = base == 16 ? 2 : 10;
+    bool fraction = false, negative = false;
+
+    for (;; pos++) {
+        if (str[pos] == '.' && !fraction) {
+            fraction = true;
+            continue;
+        }
+
+        digit = numeric_digit(str[pos], base);
+        if (digit < 0)
+            break;
+
+        if (mantissa < 0x1000000) {
+            mantissa = mantissa * base + digit;
+            if (fraction)
+                scale--;
+        } else if (!fraction)
+            scale++;
+    }
+
+    /* Hex digits count 4 binary places each */
+    if (base == 16)
+        scale *= 4;
+
+    if (is_exponent(str[pos], base)) {
+        pos++;
+        if (str[pos] == '+' || str[pos] == '-')
+            negative = str[pos++] == '-';
+        while (is_digit(str[pos])) {
+            if (exp < 100000)
+                exp = exp * 10 + str[pos] - '0';
+            pos++;
+        }
+    }
+
+    scale += negative ? -exp : exp;
+
+    for (; scale > 0 && mantissa; scale--) {
+        if (mantissa > 0x7fffffff / radix) {
+            mantissa = 0x7fffffff;
+            break;
+        }
+        mantissa *= radix;
+    }
+
+    for (; scale < 0 && mantissa; scale++)
+        mantissa /= radix;
+
+    pos_ref[0] = pos;
+    return mantissa;
+}
+
+/* Scans the preprocessing number at str, the longest run of digits, letters,
+ * dots and signs after an exponent, and computes its value and NUM_* flags.
+ * Returns length of the number. */
+int scan_numeric(char *str, int *value_ref, int *flags_ref)
 {
-    if (!loc_ref)
-        loc_ref = malloc(sizeof(location_t));
+    int len = 0, pos = 0, base = 10, value = 0, flags = 0, digit;
+    char ch;
+
+    for (;;) {
+        ch = str[len];
+        if (is_identifier(ch) || ch == '.')
+            len++;
+        else if ((ch == '+' || ch == '-') && len &&
+                 (is_exponent(str[len - 1], 10) ||
+                  is_exponent(str[len - 1], 16)))
+            len++;
+        else
+            break;
+    }
+
+    if (str[0] == '0' && (str[1] == 'x' || str[1] == 'X'))
+        base = 16;
+    else if (str[0] == '0' && (str[1] == 'b' || str[1] == 'B'))
+        base = 2;
+
+    if (base == 10) {
+        pos = numeric_decimal(str, len, &value);
+    } else {
+        pos = 2;
+        while ((digit = numeric_digit(str[pos], base)) >= 0) {
+            value = value * base + digit;
+            pos++;
+        }
+    }
+
+    if (base != 2 && (str[pos] == '.' || is_exponent(str[pos], base))) {
+        flags |= NUM_FLOAT;
+        value = numeric_float(str, base == 16 ? 2 : 0, base, &pos);
+
+        /* Exponent without digits */
+        ch = str[pos - 1];
+        if (ch == '+' || ch == '-' || is_exponent(ch, base))
+            flags |= NUM_INVALID;
+    } else if (base != 10 && pos == 2) {
+        flags |= NUM_INVALID;
+    } else if (base == 10 && str[0] == '0') {
+        /* Leading zero makes an octal integer */
+        value = 0;
+        for (int i = 1; i < pos; i++) {
+            if (str[i] > '7')
+                flags |= NUM_INVALID;
+            value = value * 8 + str[i] - '0';
+        }
+    }
+
+    while (pos < len) {
+        ch = str[pos++];
+        if (ch == 'u' || ch == 'U') {
+            flags |= flags & NUM_UNSIGNED ? NUM_INVALID : NUM_UNSIGNED;
+        } else if (ch == 'l' || ch == 'L') {
+            if (flags & (NUM_LONG | NUM_LONG_LONG))
+                flags |= NUM_INVALID;
+            if (str[pos] == ch) {
+                flags |= NUM_LONG_LONG;
+                pos++;
+            } else
+                flags |= NUM_LONG;
+        } else if ((ch == 'f' || ch == 'F') && flags & NUM_FLOAT) {
+            flags |= NUM_SINGLE;
+        } else
+            flags |= NUM_INVALID;
+    }
+
+    if (flags & NUM_FLOAT && flags & (NUM_UNSIGNED | NUM_LONG_LONG))
+        flags |= NUM_INVALID;
+
+    value_ref[0] = value;
+    flags_ref[0] = flags;
+    return len;
+}
 
+/* Copies location data to loc_ref and returns it */
+location_t *reg_lexer_cur_loc(regional_lexer_t *lexer, location_t *loc_ref)
+{
     switch (lexer->mode) {
     case LM_source: {
         loc_ref->file_idx = lexer->file_idx;
         loc_ref->col = lexer->col;
         loc_ref->line = lexer->line;
+        loc_ref->offset = lexer->pos;
         return loc_ref;
     }
     case LM_token: {
+        token_t *token = lexer->tokens_pos < lexer->tokens_len
+                             ? &lexer->tokens[lexer->tokens_pos]
+                             : lexer->cur_token;
         loc_ref->file_idx = lexer->file_idx;
-        loc_ref->col = lexer->tokens_head->loc.col;
-        loc_ref->line = lexer->tokens_head->loc.line;
+        loc_ref->col = token ? token->loc.col : 0;
+        loc_ref->line = token ? token->loc.line : 0;
+        loc_ref->offset = token ? token->loc.offset : 0;
         return loc_ref;
     }
     }
@@ -183,14 +437,22 @@ void reg_lexer_read_char(regional_lexer_t *lexer, int len)
     lexer->col += len;
 }
 
+/* Skips white space, comments and line splices, then sets token_flags of the
+ * token that follows. Only white space on the token's own logical line counts
+ * as leading. */
 void reg_lexer_skip_white_space(regional_lexer_t *lexer)
 {
     /* Only true if it's at the start of file or behind a newline character,
      * false otherwise. */
     bool after_new_line =
-        lexer->pos == 0 ||
-        (lexer->cur_token && lexer->cur_token->typ == T_newline);
+        lexer->pos == 0 || is_newline(lexer->source[lexer->pos - 1]);
+    bool spaced = false;
+    location_t loc;
     char ch;
+    int len;
+#ifdef SHEPHERD_STATS
+    int start = lexer->pos, comment_start;
+#endif
 
     while (true) {
         ch = reg_lexer_peek_char(lexer, 0);
@@ -200,149 +462,359 @@ void reg_lexer_skip_white_space(regional_lexer_t *lexer)
             lexer->col = 1;
             lexer->pos += 1;
             after_new_line = true;
+            spaced = false;
             continue;
         }
 
-        if (is_white_space(ch) || (!lexer->inside_macro && ch == '\\')) {
+        if (is_white_space(ch)) {
             lexer->pos += 1;
             lexer->col += 1;
+            spaced = true;
+            continue;
+        }
+
+        /* Splices join lines, so they neither end a directive nor count as
+         * white space */
+        if (ch == '\\' && (len = splice_len(lexer->source + lexer->pos))) {
+            lexer->line += 1;
+            lexer->col = 1;
+            lexer->pos += len;
+            continue;
+        }
+
+        /* Comments count as white space, so a directive may follow them */
+        if (ch == '/' && reg_lexer_peek_char(lexer, 1) == '*') {
+#ifdef SHEPHERD_STATS
+            comment_start = lexer->pos;
+#endif
+            reg_lexer_read_char(lexer, 2);
+
+            while (true) {
+                ch = reg_lexer_peek_char(lexer, 0);
+
+                if (!ch) {
+                    error("Unenclosed comment block",
+                          reg_lexer_cur_loc(lexer, &loc));
+                    break;
+                }
+
+                if (ch == '*' && reg_lexer_peek_char(lexer, 1) == '/')
+                    break;
+
+                if (is_newline(ch)) {
+                    lexer->line += 1;
+                    lexer->col = 1;
+                    lexer->pos += 1;
+                    continue;
+                }
+
+                reg_lexer_read_char(lexer, 1);
+            }
+
+            if (ch)
+                reg_lexer_read_char(lexer, 2);
+#ifdef SHEPHERD_STATS
+            STATS.comment_bytes += lexer->pos - comment_start;
+            start += lexer->pos - comment_start;
+#endif
+            spaced = true;
+            continue;
+        }
+
+        /* C99 style comment, ends right before the newline */
+        if (ch == '/' && reg_lexer_peek_char(lexer, 1) == '/') {
+#ifdef SHEPHERD_STATS
+            comment_start = lexer->pos;
+#endif
+            do {
+                /* A splice carries the comment over to the next line */
+                if ((len = splice_len(lexer->source + lexer->pos))) {
+                    lexer->line += 1;
+                    lexer->col = 1;
+                    lexer->pos += len;
+                } else
+                    reg_lexer_read_char(lexer, 1);
+                ch = reg_lexer_peek_char(lexer, 0);
+            } while (ch && !is_newline(ch));
+            spaced = true;
+#ifdef SHEPHERD_STATS
+            STATS.comment_bytes += lexer->pos - comment_start;
+            start += lexer->pos - comment_start;
+#endif
             continue;
         }
 
         break;
     }
 
+#ifdef SHEPHERD_STATS
+    STATS.white_space_bytes += lexer->pos - start;
+#endif
+
     lexer->after_newline = after_new_line;
+    lexer->token_flags = spaced ? TK_LEADING_SPACE : 0;
+    if (after_new_line)
+        lexer->token_flags |= TK_LINE_START;
 }
 
-void reg_lexer_make_token(regional_lexer_t *lexer, token_type_t typ, int len);
-void reg_lexer_make_identifier_token(regional_lexer_t *lexer, int len);
+/* Allocates token at the current position of a source lexer */
+token_t *reg_lexer_alloc_token(regional_lexer_t *lexer, token_type_t typ)
+{
+    token_t *token = alloc_token(lexer->arena, 1);
+    reg_lexer_cur_loc(lexer, &token->loc);
+    token->typ = typ;
+    token->hash = 0;
+    token->flags = lexer->token_flags;
+    token->str = NULL;
+    token->str_len = 0;
+    token->value = 0;
+    token->num_flags = 0;
+    token->symbol = -1;
+    token->len = 0;
+    return token;
+}
 
-void reg_lexer_next_token(regional_lexer_t *lexer)
+/* Copies spelling of token unless lexer is kinds-only, where it is left to
+ * token_literal. Directives always get theirs, the preprocessor reads them. */
+void reg_lexer_spell(regional_lexer_t *lexer, token_t *token, char *spelling)
 {
-    if (lexer->mode == LM_token) {
-        if (lexer->tokens_head) {
-            lexer->cur_token = lexer->tokens_head;
-            lexer->tokens_head = lexer->tokens_head->next;
-        } else if (lexer->cur_token->typ != T_eof) {
-            /* Allocates dummy token with type T_eof */
-            token_t *eof_token = alloc_token(lexer->arena, 1);
-            memcpy(&eof_token->loc, &lexer->cur_token->loc, sizeof(location_t));
-            eof_token->typ = T_eof;
-            lexer->cur_token = eof_token;
-        }
+    if (lexer->kinds_only && !lexer->inside_macro) {
+        token->literal[0] = '\0';
         return;
     }
 
-    char ch, token_str[MAX_TOKEN_LEN];
-    int len;
+    token_spell(token, spelling);
+}
+
+/* Decodes escape sequence at str, the part after its backslash, into ch_ref.
+ * Returns its length, 0 if it is no valid escape. */
+int decode_escape(char *str, char *ch_ref)
+{
+    int value = 0, len = 0, digit;
+    char ch = str[0];
+
+    if (ch >= '0' && ch <= '7') {
+        while (len < 3 && str[len] >= '0' && str[len] <= '7')
+            value = value * 8 + str[len++] - '0';
+    } else if (ch == 'x') {
+        for (len = 1; (digit = numeric_digit(str[len], 16)) >= 0; len++)
+            value = (value * 16 + digit) & 255;
+        if (len == 1)
+            return 0;
+    } else {
+        len = 1;
+        if (ch == 'n')
+            value = '\n';
+        else if (ch == 't')
+            value = '\t';
+        else if (ch == 'r')
+            value = '\r';
+        else if (ch == 'a')
+            value = 7;
+        else if (ch == 'b')
+            value = 8;
+        else if (ch == 'f')
+            value = 12;
+        else if (ch == 'v')
+            value = 11;
+        else if (ch == '\\' || ch == '\'' || ch == '"' || ch == '?')
+            value = ch;
+        else
+            return 0;
+    }
 
-    reg_lexer_skip_white_space(lexer);
-    ch = reg_lexer_peek_char(lexer, 0);
+    ch_ref[0] = value;
+    return len;
+}
 
-    if (ch == '/') {
-        ch = reg_lexer_peek_char(lexer, 1);
+/* Decodes raw_len bytes of string literal contents at raw into str, which
+ * has room for all of them. Invalid escapes are taken as they are, they are
+ * reported while scanning. */
+void string_decode(char *raw, int raw_len, char *str)
+{
+    int len = 0, escape_len;
+
+    for (char *p = raw; p < raw + raw_len; p++) {
+        if (*p == '\\') {
+            escape_len = decode_escape(p + 1, &str[len]);
+            if (!escape_len) {
+                str[len] = p[1];
+                escape_len = p[1] != '\0';
+            }
+            p += escape_len;
+        } else
+            str[len] = *p;
+        len++;
+    }
+}
 
-        if (ch == '*') {
-            /* in a comment, skip until end */
-            len = 2;
+/* Scans string literal at current position. The scan only stops at a quote,
+ * backslash, newline or end of source; contents without escapes, by far the
+ * most common ones, are read in place and never copied beyond literal.
+ * Escaped contents are decoded into string storage, without length limit.
+ * Kinds-only lexers copy and decode nothing, see token_string. */
+void reg_lexer_make_string_token(regional_lexer_t *lexer)
+{
+    char *start = lexer->source + lexer->pos + 1, *end = start, ch;
+    bool escaped = false, closed;
+    location_t loc;
+    token_t *token;
+    int len, escape_len, skipped = 0;
+
+    for (;;) {
+        while (*end != '"' && *end != '\\' && *end && !is_newline(*end))
+            end++;
+        if (*end != '\\')
+            break;
 
-            do {
-                ch = reg_lexer_peek_char(lexer, len);
+        /* Spliced literal, leaves it to the slow path */
+        if (splice_len(end)) {
+            lexer->pos = end - lexer->source;
+            return;
+        }
 
-                if (ch == '*' && reg_lexer_peek_char(lexer, len + 1) == '/') {
-                    reg_lexer_read_char(lexer, len + 2);
-                    reg_lexer_next_token(lexer);
-                    return;
-                }
+        escape_len = decode_escape(end + 1, &ch);
+        if (!escape_len) {
+            reg_lexer_read_char(lexer, end - start + 2);
+            error("Unexpected escaped character: %c",
+                  reg_lexer_cur_loc(lexer, &loc), end[1]);
+            reg_lexer_read_char(lexer, -(end - start + 2));
+            /* Recovers by taking the character as it is */
+            escape_len = end[1] != '\0';
+        }
+        end += 1 + escape_len;
+        skipped += escape_len;
+        escaped = true;
+    }
 
-                len++;
-            } while (ch);
+    /* Recovers by ending the literal at its end of line */
+    closed = *end == '"';
+    if (!closed)
+        error("Missing terminating %c character",
+              reg_lexer_cur_loc(lexer, &loc), '"');
+
+    token = reg_lexer_alloc_token(lexer, T_string);
+    token->str_len = end - start - skipped;
+
+    if (lexer->kinds_only && !lexer->inside_macro) {
+        /* Left for token_string and token_literal to decode and copy */
+        if (escaped)
+            token->len = end - start;
+        token->literal[0] = '\0';
+    } else {
+        if (escaped) {
+            token->str = string_alloc(token->str_len);
+            string_decode(start, end - start, token->str);
+        }
+        len = token->str_len;
+        if (len > MAX_TOKEN_LEN - 1)
+            len = MAX_TOKEN_LEN - 1;
+        memcpy(token->literal, token->str ? token->str : start, len);
+        token->literal[len] = '\0';
+    }
 
-            if (!ch)
-                error("Unenclosed comment block",
-                      reg_lexer_cur_loc(lexer, NULL));
-        } else if (ch == '/') {
-            /* C99 style comment */
-            len = 2;
+    lexer->cur_token = token;
+    reg_lexer_read_char(lexer, end - start + 1 + closed);
+}
 
-            do {
-                ch = reg_lexer_peek_char(lexer, len);
-                len++;
-            } while (!is_newline(ch) && ch);
+/* Scans numeric literal at current position, its value is computed along */
+void reg_lexer_make_numeric_token(regional_lexer_t *lexer)
+{
+    token_t *token = reg_lexer_alloc_token(lexer, T_numeric);
+    char *str = lexer->source + lexer->pos;
+    int len = scan_numeric(str, &token->value, &token->num_flags);
+    int copy_len = len;
+
+    if (len >= MAX_TOKEN_LEN) {
+        error("Numeric literal is too long", &token->loc);
+        copy_len = MAX_TOKEN_LEN - 1;
+    }
 
-            reg_lexer_read_char(lexer, len);
-            reg_lexer_next_token(lexer);
-            return;
-        } else if (ch == ' ') {
-            /* single '/', predict divide */
-            reg_lexer_make_token(lexer, T_divide, 1);
-            return;
-        }
+    token->len = copy_len;
+    reg_lexer_spell(lexer, token, str);
+    lexer->cur_token = token;
+    reg_lexer_read_char(lexer, len);
+}
+
+void reg_lexer_make_identifier_token(regional_lexer_t *lexer,
+                                     int len,
+                                     int hash);
 
-        /* TODO: check invalid cases */
-        error("TODO: Unimplemented '/' compound operator",
-              reg_lexer_cur_loc(lexer, NULL));
+void reg_lexer_make_token(regional_lexer_t *lexer, token_type_t typ, int len);
+
+/* Scans the token at the current position of a source lexer, white space is
+ * already skipped. Returns false if no token starts there, the offending
+ * character is reported and dropped then. */
+bool reg_lexer_scan_token(regional_lexer_t *lexer)
+{
+    char ch = reg_lexer_peek_char(lexer, 0);
+    location_t loc;
+    int len;
+
+    if (ch == '/') {
+        /* comments are skipped as white space, so it's a divide */
+        reg_lexer_make_token(lexer, T_divide, 1);
+        return true;
     }
 
     if (ch == '#') {
         if (reg_lexer_peek_char(lexer, 1) == '#') {
             reg_lexer_make_token(lexer, T_cppd_hashhash, 2);
-            return;
+            return true;
         }
 
         reg_lexer_make_token(lexer, T_cppd_hash, 1);
-        return;
+        return true;
     }
 
     if (ch == '(') {
         reg_lexer_make_token(lexer, T_open_bracket, 1);
-        return;
+        return true;
     }
 
     if (ch == ')') {
         reg_lexer_make_token(lexer, T_close_bracket, 1);
-        return;
+        return true;
     }
 
     if (ch == '{') {
         reg_lexer_make_token(lexer, T_open_curly, 1);
-        return;
+        return true;
     }
 
     if (ch == '}') {
         reg_lexer_make_token(lexer, T_close_curly, 1);
-        return;
+        return true;
     }
 
     if (ch == '[') {
         reg_lexer_make_token(lexer, T_open_square, 1);
-        return;
+        return true;
     }
 
     if (ch == ']') {
         reg_lexer_make_token(lexer, T_close_square, 1);
-        return;
+        return true;
     }
 
     if (ch == ',') {
         reg_lexer_make_token(lexer, T_comma, 1);
-        return;
+        return true;
     }
 
     if (ch == '^') {
         reg_lexer_make_token(lexer, T_bit_xor, 1);
-        return;
+        return true;
     }
 
     if (ch == '~') {
         reg_lexer_make_token(lexer, T_bit_not, 1);
-        return;
+        return true;
     }
 
     if (ch == '*') {
         reg_lexer_make_token(lexer, T_asterisk, 1);
-        return;
+        return true;
     }
 
     if (ch == '&') {
@@ -350,16 +822,16 @@ void reg_lexer_next_token(regional_lexer_t *lexer)
 
         if (ch == '&') {
             reg_lexer_make_token(lexer, T_log_and, 2);
-            return;
+            return true;
         }
 
         if (ch == '=') {
             reg_lexer_make_token(lexer, T_andeq, 2);
-            return;
+            return true;
         }
 
         reg_lexer_make_token(lexer, T_ampersand, 1);
-        return;
+        return true;
     }
 
     if (ch == '|') {
@@ -367,16 +839,16 @@ void reg_lexer_next_token(regional_lexer_t *lexer)
 
         if (ch == '|') {
             reg_lexer_make_token(lexer, T_log_or, 2);
-            return;
+            return true;
         }
 
         if (ch == '=') {
             reg_lexer_make_token(lexer, T_oreq, 2);
-            return;
+            return true;
         }
 
         reg_lexer_make_token(lexer, T_bit_or, 1);
-        return;
+        return true;
     }
 
     if (ch == '<') {
@@ -384,16 +856,16 @@ void reg_lexer_next_token(regional_lexer_t *lexer)
 
         if (ch == '<') {
             reg_lexer_make_token(lexer, T_lshift, 2);
-            return;
+            return true;
         }
 
         if (ch == '=') {
             reg_lexer_make_token(lexer, T_le, 2);
-            return;
+            return true;
         }
 
         reg_lexer_make_token(lexer, T_lt, 1);
-        return;
+        return true;
     }
 
     if (ch == '>') {
@@ -401,42 +873,46 @@ void reg_lexer_next_token(regional_lexer_t *lexer)
 
         if (ch == '>') {
             reg_lexer_make_token(lexer, T_rshift, 2);
-            return;
+            return true;
         }
 
         if (ch == '=') {
             reg_lexer_make_token(lexer, T_ge, 2);
-            return;
+            return true;
         }
 
         reg_lexer_make_token(lexer, T_gt, 1);
-        return;
+        return true;
     }
 
     if (ch == '%') {
         reg_lexer_make_token(lexer, T_mod, 1);
-        return;
+        return true;
     }
 
     if (ch == '!') {
         if (reg_lexer_peek_char(lexer, 1) == '=') {
             reg_lexer_make_token(lexer, T_noteq, 2);
-            return;
+            return true;
         }
 
         reg_lexer_make_token(lexer, T_log_not, 1);
-        return;
+        return true;
     }
 
     if (ch == '.') {
+        if (is_digit(reg_lexer_peek_char(lexer, 1))) {
+            reg_lexer_make_numeric_token(lexer);
+            return true;
+        }
         if (reg_lexer_peek_char(lexer, 1) == '.' &&
             reg_lexer_peek_char(lexer, 2) == '.') {
             reg_lexer_make_token(lexer, T_elipsis, 3);
-            return;
+            return true;
         }
 
         reg_lexer_make_token(lexer, T_dot, 1);
-        return;
+        return true;
     }
 
     if (ch == '-') {
@@ -444,21 +920,21 @@ void reg_lexer_next_token(regional_lexer_t *lexer)
 
         if (ch == '>') {
             reg_lexer_make_token(lexer, T_arrow, 2);
-            return;
+            return true;
         }
 
         if (ch == '-') {
             reg_lexer_make_token(lexer, T_decrement, 2);
-            return;
+            return true;
         }
 
         if (ch == '=') {
             reg_lexer_make_token(lexer, T_minuseq, 2);
-            return;
+            return true;
         }
 
         reg_lexer_make_token(lexer, T_minus, 1);
-        return;
+        return true;
     }
 
     if (ch == '+') {
@@ -466,184 +942,279 @@ void reg_lexer_next_token(regional_lexer_t *lexer)
 
         if (ch == '+') {
             reg_lexer_make_token(lexer, T_increment, 2);
-            return;
+            return true;
         }
 
         if (ch == '=') {
             reg_lexer_make_token(lexer, T_pluseq, 2);
-            return;
+            return true;
         }
 
         reg_lexer_make_token(lexer, T_plus, 1);
-        return;
+        return true;
     }
 
     if (ch == ';') {
         reg_lexer_make_token(lexer, T_semicolon, 1);
-        return;
+        return true;
+    }
+
+    if (ch == '?') {
+        reg_lexer_make_token(lexer, T_question, 1);
+        return true;
+    }
+
+    if (ch == ':') {
+        reg_lexer_make_token(lexer, T_colon, 1);
+        return true;
     }
 
     if (ch == '=') {
         if (reg_lexer_peek_char(lexer, 1) == '=') {
-            reg_lexer_make_token(lexer, T_eq, 1);
-            return;
+            reg_lexer_make_token(lexer, T_eq, 2);
+            return true;
         }
 
         reg_lexer_make_token(lexer, T_assign, 1);
-        return;
+        return true;
     }
 
     if (ch == '\0') {
         reg_lexer_make_token(lexer, T_eof, 0);
-        return;
+        return true;
     }
 
     if (ch == '"') {
-        int output_len = 0;
-        bool special = false;
-
-        do {
-            len++;
-            ch = reg_lexer_peek_char(lexer, len);
-
-            if (special) {
-                if (ch == 'n')
-                    token_str[output_len++] = '\n';
-                else if (ch == '"')
-                    token_str[output_len++] = '"';
-                else if (ch == 'r')
-                    token_str[output_len++] = '\r';
-                else if (ch == '\'')
-                    token_str[output_len++] = '\'';
-                else if (ch == 't')
-                    token_str[output_len++] = '\t';
-                else if (ch == '\\')
-                    token_str[output_len++] = '\\';
-                else if (ch == '0')
-                    token_str[output_len++] = '\0';
-                else {
-                    reg_lexer_read_char(lexer, len);
-                    error("Unexpected escaped character: %c",
-                          reg_lexer_cur_loc(lexer, NULL), ch);
-                }
+        reg_lexer_make_string_token(lexer);
+        return true;
+    }
 
-                continue;
-            } else if (ch != '\\') {
-                token_str[output_len++] = ch;
+    if (ch == '\'') {
+        char value;
+        bool closed;
+
+        /* Spliced literal, leaves it to the slow path */
+        for (char *p = lexer->source + lexer->pos + 1;
+             *p && *p != '\'' && !is_newline(*p); p++) {
+            if (splice_len(p)) {
+                lexer->pos = p - lexer->source;
+                return true;
             }
-
-            special = ch == '\\';
-        } while (ch && ch != '"');
-
-        if (special) {
-            reg_lexer_read_char(lexer, len - 1);
-            error("Incomplete escaped character",
-                  reg_lexer_cur_loc(lexer, NULL));
+            if (*p == '\\' && p[1])
+                p++;
         }
 
-        if (!ch)
-            error("Unenclosed string literal", reg_lexer_cur_loc(lexer, NULL));
-
-        token_t *token = alloc_token(lexer->arena, 1);
-        token->loc.line = lexer->line;
-        token->loc.col = lexer->col;
-        token->typ = T_string;
-        strncpy(token->literal, token_str, output_len);
-        token->literal[output_len] = '\0';
-        lexer->cur_token = token;
-        reg_lexer_read_char(lexer, len + 1);
-        return;
-    }
-
-    if (ch == '\'') {
-        len = 1;
-        ch = reg_lexer_peek_char(lexer, len);
+        len = 1;
+        ch = reg_lexer_peek_char(lexer, len);
 
         if (ch == '\\') {
-            len++;
-            ch = reg_lexer_peek_char(lexer, len);
+            int escape_len =
+                decode_escape(lexer->source + lexer->pos + 2, &value);
 
-            if (ch == 'n')
-                token_str[0] = '\n';
-            else if (ch == '"')
-                token_str[0] = '"';
-            else if (ch == 'r')
-                token_str[0] = '\r';
-            else if (ch == '\'')
-                token_str[0] = '\'';
-            else if (ch == 't')
-                token_str[0] = '\t';
-            else if (ch == '\\')
-                token_str[0] = '\\';
-            else if (ch == '0')
-                token_str[0] = '\0';
-            else {
-                reg_lexer_read_char(lexer, len);
+            if (!escape_len) {
+                reg_lexer_read_char(lexer, len + 1);
                 error("Unexpected escaped character: %c",
-                      reg_lexer_cur_loc(lexer, NULL), ch);
+                      reg_lexer_cur_loc(lexer, &loc),
+                      reg_lexer_peek_char(lexer, 0));
+                reg_lexer_read_char(lexer, -(len + 1));
+                /* Recovers by taking the character as it is */
+                value = reg_lexer_peek_char(lexer, len + 1);
+                escape_len = 1;
             }
-        } else
-            token_str[0] = ch;
-
-        len++;
-        ch = reg_lexer_peek_char(lexer, len);
+            len += 1 + escape_len;
+        } else {
+            value = ch;
+            len++;
+        }
 
-        if (ch != '\'')
+        closed = reg_lexer_peek_char(lexer, len) == '\'';
+        if (!closed) {
             error("Unenclosed character literal",
-                  reg_lexer_cur_loc(lexer, NULL));
-
-        token_t *token = alloc_token(lexer->arena, 1);
-        token->loc.line = lexer->line;
-        token->loc.col = lexer->col;
-        token->typ = T_char;
-        strncpy(token->literal, token_str, 1);
-        token->literal[1] = '\0';
+                  reg_lexer_cur_loc(lexer, &loc));
+            /* Recovers by ending the literal before its end of line */
+            for (int i = 1; i < len; i++) {
+                ch = reg_lexer_peek_char(lexer, i);
+                if (!ch || is_newline(ch)) {
+                    len = i;
+                    break;
+                }
+            }
+        }
+
+        token_t *token = reg_lexer_alloc_token(lexer, T_char);
+        /* Kinds-only lexers leave literal to token_literal */
+        if (!lexer->kinds_only || lexer->inside_macro) {
+            token->literal[0] = value;
+            token->literal[1] = '\0';
+        }
+        token->value = value;
         lexer->cur_token = token;
-        reg_lexer_read_char(lexer, len + 1);
-        return;
+        reg_lexer_read_char(lexer, len + closed);
+        return true;
     }
 
     if (ch == '\\') {
         reg_lexer_make_token(lexer, T_backslash, 1);
-        return;
+        return true;
     }
 
     if (is_newline(ch)) {
         reg_lexer_make_token(lexer, T_newline, 1);
-        return;
+        lexer->line++;
+        lexer->col = 1;
+        return true;
     }
 
     if (is_identifier_start(ch)) {
+        int hash = HASH_SEED;
         len = 0;
 
+        /* Hashes while scanning, so spelling is never walked again for keyword
+         * or macro lookups */
         do {
+            hash = ((hash << 5) + hash + ch) & HASH_MASK;
             len++;
             ch = reg_lexer_peek_char(lexer, len);
         } while (is_identifier(ch));
 
-        reg_lexer_make_identifier_token(lexer, len);
-        return;
+        reg_lexer_make_identifier_token(lexer, len, hash);
+        return true;
     }
 
     if (is_digit(ch)) {
-        len = 0;
-
-        /* TODO: Handle hexadecimal numeric */
-        do {
-            len++;
-            ch = reg_lexer_peek_char(lexer, len);
-        } while (is_digit(ch));
-
-        reg_lexer_make_token(lexer, T_numeric, len);
-        return;
+        reg_lexer_make_numeric_token(lexer);
+        return true;
     }
 
     if (is_newline(ch)) {
         reg_lexer_make_token(lexer, T_newline, 1);
+        return true;
+    }
+
+    error("Unexpected character: %c", reg_lexer_cur_loc(lexer, &loc), ch);
+
+    /* Recovers by dropping the character, the caller scans again */
+    reg_lexer_read_char(lexer, 1);
+    return false;
+}
+
+/* Slow path of a token that line splices run through, lexer is back at start
+ * of the token. Scans the spliced out logical text of the token, copied from
+ * start up to the end of its logical line if it is a literal, or the first
+ * white space after a splice otherwise, then advances the source past it. */
+void reg_lexer_scan_spliced(regional_lexer_t *lexer,
+                            int start,
+                            int line,
+                            int col)
+{
+    char *raw = lexer->source + start, *end = raw, *source = lexer->source;
+    char *buf;
+    bool quoted = raw[0] == '"' || raw[0] == '\'', spliced = false;
+    bool kinds_only = lexer->kinds_only;
+    int source_len = lexer->source_len, size, len = 0, splice;
+    token_t *token;
+
+    while (*end && !is_newline(*end)) {
+        if ((splice = splice_len(end))) {
+            end += splice;
+            spliced = true;
+            continue;
+        }
+        if (spliced && !quoted && is_white_space(*end))
+            break;
+        end++;
+    }
+
+    size = end - raw + 2;
+    buf = mem_alloc(MEM_reg_lexers, size);
+    for (char *p = raw; p < end;) {
+        if ((splice = splice_len(p)))
+            p += splice;
+        else
+            buf[len++] = *p++;
+    }
+    /* Keeps what ended the copy, the scan stops there as it would in source */
+    buf[len++] = *end;
+    buf[len] = '\0';
+
+    lexer->source = buf;
+    lexer->source_len = len;
+    lexer->pos = 0;
+    lexer->line = line;
+    lexer->col = col;
+    /* Spelling in source has splices, so it can not be read lazily */
+    lexer->kinds_only = false;
+    reg_lexer_scan_token(lexer);
+    lexer->kinds_only = kinds_only;
+    len = lexer->pos;
+    lexer->source = source;
+    lexer->source_len = source_len;
+    lexer->pos = start;
+    lexer->line = line;
+    lexer->col = col;
+
+    token = lexer->cur_token;
+    token->loc.offset = start;
+    /* Contents read in place would be spliced in source, copies them */
+    if (token->typ == T_string && !token->str) {
+        token->str = string_alloc(token->str_len);
+        memcpy(token->str, buf + 1, token->str_len);
+    }
+
+    while (len > 0) {
+        if ((splice = splice_len(lexer->source + lexer->pos))) {
+            lexer->pos += splice;
+            lexer->line++;
+            lexer->col = 1;
+            continue;
+        }
+        if (is_newline(lexer->source[lexer->pos])) {
+            lexer->pos++;
+            lexer->line++;
+            lexer->col = 1;
+        } else
+            reg_lexer_read_char(lexer, 1);
+        len--;
+    }
+
+    mem_free(MEM_reg_lexers, buf, size);
+}
+
+void reg_lexer_next_token(regional_lexer_t *lexer)
+{
+    TRACE_TICKS++;
+
+    if (lexer->mode == LM_token) {
+        if (lexer->tokens_pos < lexer->tokens_len) {
+            lexer->cur_token = &lexer->tokens[lexer->tokens_pos++];
+        } else if (!lexer->cur_token || lexer->cur_token->typ != T_eof) {
+            /* Allocates dummy token with type T_eof */
+            token_t *eof_token = alloc_token(lexer->arena, 1);
+            reg_lexer_cur_loc(lexer, &eof_token->loc);
+            eof_token->typ = T_eof;
+            eof_token->hash = 0;
+            eof_token->flags = 0;
+            eof_token->symbol = -1;
+            eof_token->len = 0;
+            eof_token->literal[0] = '\0';
+            lexer->cur_token = eof_token;
+        }
         return;
     }
 
-    error("Unexpected character: %c", reg_lexer_cur_loc(lexer, NULL), ch);
+    int start, line, col;
+
+    do {
+        reg_lexer_skip_white_space(lexer);
+        start = lexer->pos;
+        line = lexer->line;
+        col = lexer->col;
+    } while (!reg_lexer_scan_token(lexer));
+
+    /* Fast path assumes that no splice is inside the token, which stopped
+     * right before a splice otherwise */
+    if (splice_len(lexer->source + lexer->pos))
+        reg_lexer_scan_spliced(lexer, start, line, col);
 }
 
 bool reg_lexer_accept_token(regional_lexer_t *lexer, token_type_t typ)
@@ -668,7 +1239,7 @@ bool reg_lexer_peek_token(regional_lexer_t *lexer, token_type_t typ, char *buf)
         if (!buf)
             return true;
 
-        strcpy(buf, lexer->cur_token->literal);
+        strcpy(buf, token_literal(lexer->cur_token));
         return true;
     }
 
@@ -684,13 +1255,13 @@ void reg_lexer_ident_token(regional_lexer_t *lexer, token_type_t typ, char *buf)
         if (!buf)
             return;
 
-        strcpy(buf, lexer->cur_token->literal);
+        strcpy(buf, token_literal(lexer->cur_token));
         reg_lexer_next_token(lexer);
         return;
     }
 
     error("Unexpected token `%s`", &lexer->cur_token->loc,
-          lexer->cur_token->literal);
+          token_literal(lexer->cur_token));
 }
 
 void reg_lexer_expect_token(regional_lexer_t *lexer, token_type_t typ)
@@ -704,62 +1275,29 @@ void reg_lexer_expect_token(regional_lexer_t *lexer, token_type_t typ)
     }
 
     error("Unexpected token `%s`", &lexer->cur_token->loc,
-          lexer->cur_token->literal);
+          token_literal(lexer->cur_token));
 }
 
 void reg_lexer_make_token(regional_lexer_t *lexer, token_type_t typ, int len)
 {
-    token_t *token = alloc_token(lexer->arena, 1);
-    token->loc.line = lexer->line;
-    token->loc.col = lexer->col;
-    token->typ = typ;
-    strncpy(token->literal, lexer->source + lexer->pos, len);
-    token->literal[len] = '\0';
+    token_t *token = reg_lexer_alloc_token(lexer, typ);
+    token->len = len;
+    reg_lexer_spell(lexer, token, lexer->source + lexer->pos);
     lexer->cur_token = token;
     reg_lexer_read_char(lexer, len);
 }
 
-void reg_lexer_make_identifier_token(regional_lexer_t *lexer, int len)
+void reg_lexer_make_identifier_token(regional_lexer_t *lexer,
+                                     int len,
+                                     int hash)
 {
-    char a[100];
-    token_t *token = alloc_token(lexer->arena, 1);
-    token->loc.line = lexer->line;
-    token->loc.col = lexer->col;
-    strncpy(token->literal, lexer->source + lexer->pos, len);
-    token->literal[len] = '\0';
-
-    if (!strcmp(token->literal, "if"))
-        token->typ = T_if;
-    else if (!strcmp(token->literal, "while"))
-        token->typ = T_while;
-    else if (!strcmp(token->literal, "for"))
-        token->typ = T_for;
-    else if (!strcmp(token->literal, "do"))
-        token->typ = T_do;
-    else if (!strcmp(token->literal, "else"))
-        token->typ = T_else;
-    else if (!strcmp(token->literal, "return"))
-        token->typ = T_return;
-    else if (!strcmp(token->literal, "typedef"))
-        token->typ = T_typedef;
-    else if (!strcmp(token->literal, "enum"))
-        token->typ = T_enum;
-    else if (!strcmp(token->literal, "struct"))
-        token->typ = T_struct;
-    else if (!strcmp(token->literal, "sizeof"))
-        token->typ = T_sizeof;
-    else if (!strcmp(token->literal, "switch"))
-        token->typ = T_switch;
-    else if (!strcmp(token->literal, "case"))
-        token->typ = T_case;
-    else if (!strcmp(token->literal, "break"))
-        token->typ = T_break;
-    else if (!strcmp(token->literal, "default"))
-        token->typ = T_default;
-    else if (!strcmp(token->literal, "continue"))
-        token->typ = T_continue;
-    else
-        token->typ = T_identifier;
+    token_t *token = reg_lexer_alloc_token(lexer, T_identifier);
+    token->hash = hash;
+    token->len = len;
+    token->typ = find_keyword(lexer->source + lexer->pos, len, hash);
+    if (token->typ == T_identifier)
+        token->symbol = symbol_intern(lexer->source + lexer->pos, len, hash);
+    reg_lexer_spell(lexer, token, lexer->source + lexer->pos);
 
     lexer->cur_token = token;
     reg_lexer_read_char(lexer, len);
@@ -767,7 +1305,164 @@ void reg_lexer_make_identifier_token(regional_lexer_t *lexer, int len)
 
 void reg_lexer_free(regional_lexer_t *lexer)
 {
-    free(lexer);
+    if (lexer && lexer->traced)
+        trace_end(lexer->mode == LM_source ? TRACE_FILE : TRACE_MACRO);
+    mem_free(MEM_reg_lexers, lexer, sizeof(regional_lexer_t));
+}
+
+/* Returns position of the start of the line after the one pos is on. A line
+ * only ends at a newline that is neither escaped nor inside a block comment,
+ * and quotes are honoured so a comment opener in a literal is not one.
+ * Newlines passed are counted on lexer. */
+int reg_lexer_skip_line(regional_lexer_t *lexer, int pos)
+{
+    char *source = lexer->source, quote;
+    int splice;
+
+    while (pos < lexer->source_len && !is_newline(source[pos])) {
+        if ((splice = splice_len(source + pos))) {
+            pos += splice;
+            lexer->line++;
+            continue;
+        }
+
+        if (source[pos] == '/' && source[pos + 1] == '*') {
+            pos += 2;
+            while (pos < lexer->source_len &&
+                   !(source[pos] == '*' && source[pos + 1] == '/')) {
+                if (is_newline(source[pos]))
+                    lexer->line++;
+                pos++;
+            }
+            pos += 2;
+            continue;
+        }
+
+        /* A splice carries the comment over to the next line */
+        if (source[pos] == '/' && source[pos + 1] == '/') {
+            while (pos < lexer->source_len && !is_newline(source[pos])) {
+                if ((splice = splice_len(source + pos))) {
+                    pos += splice;
+                    lexer->line++;
+                } else
+                    pos++;
+            }
+            break;
+        }
+
+        if (source[pos] == '"' || source[pos] == '\'') {
+            /* An unterminated literal, e.g. an apostrophe in dead text, ends
+             * with the line */
+            quote = source[pos++];
+            while (pos < lexer->source_len && source[pos] != quote &&
+                   !is_newline(source[pos])) {
+                if ((splice = splice_len(source + pos))) {
+                    pos += splice;
+                    lexer->line++;
+                } else
+                    pos += source[pos] == '\\' && source[pos + 1] ? 2 : 1;
+            }
+            if (source[pos] == quote)
+                pos++;
+            continue;
+        }
+
+        pos++;
+    }
+
+    if (pos < lexer->source_len) {
+        pos++;
+        lexer->line++;
+    }
+
+    return pos < lexer->source_len ? pos : lexer->source_len;
+}
+
+/* Advances from the start of a line to the start of the next line whose first
+ * non-blank character is '#', or to the end of source, without tokenizing
+ * anything in between. Comments and splices before the '#' count as blanks,
+ * as they do for the lexer. Returns position of the '#', or the end of source
+ * if there is none. */
+int reg_lexer_skip_to_directive(regional_lexer_t *lexer)
+{
+    char *source = lexer->source;
+    int pos = lexer->pos, line_start, splice;
+
+    while (pos < lexer->source_len) {
+        line_start = pos;
+
+        /* Newlines inside comments are left for whoever reads the line */
+        while (pos < lexer->source_len) {
+            if (is_white_space(source[pos])) {
+                pos++;
+            } else if ((splice = splice_len(source + pos))) {
+                pos += splice;
+            } else if (source[pos] == '/' && source[pos + 1] == '*') {
+                pos += 2;
+                while (pos < lexer->source_len &&
+                       !(source[pos] == '*' && source[pos + 1] == '/'))
+                    pos++;
+                pos += 2;
+            } else
+                break;
+        }
+
+        if (pos < lexer->source_len && source[pos] == '#') {
+            lexer->pos = line_start;
+            lexer->col = 1;
+            return pos;
+        }
+
+        pos = reg_lexer_skip_line(lexer, line_start);
+    }
+
+    lexer->pos = lexer->source_len;
+    lexer->col = 1;
+    return lexer->source_len;
+}
+
+/* Skips a conditional group that is not taken without tokenizing it, stops
+ * at the start of the line holding #elif, #else or #endif of the same nesting
+ * level, or at the end of source. */
+void reg_lexer_skip_group(regional_lexer_t *lexer)
+{
+    char *source = lexer->source, name[MAX_DIRECTIVE_LEN];
+    int pos, depth = 0;
+#ifdef SHEPHERD_STATS
+    int start = lexer->pos;
+#endif
+
+    while (true) {
+        int len = 0;
+
+        pos = reg_lexer_skip_to_directive(lexer) + 1;
+        if (lexer->pos >= lexer->source_len)
+            break;
+
+        while (is_white_space(source[pos]))
+            pos++;
+        while (is_identifier(source[pos]) && len < MAX_DIRECTIVE_LEN - 1)
+            name[len++] = source[pos++];
+        name[len] = '\0';
+
+        if (!strcmp(name, "if") || !strcmp(name, "ifdef") ||
+            !strcmp(name, "ifndef")) {
+            depth++;
+        } else if (!strcmp(name, "elif") || !strcmp(name, "else") ||
+                   !strcmp(name, "endif")) {
+            if (!depth)
+                break;
+
+            if (!strcmp(name, "endif"))
+                depth--;
+        }
+
+        lexer->pos = reg_lexer_skip_line(lexer, pos);
+    }
+
+#ifdef SHEPHERD_STATS
+    STATS.dead_bytes += lexer->pos - start;
+#endif
 }
 
 typedef struct {
@@ -788,6 +1483,10 @@ void lexer_stack_push(regional_lexer_stack_t *stack, regional_lexer_t *lexer)
         return;
 
     stack->lexers[stack->len++] = lexer;
+#ifdef SHEPHERD_STATS
+    if (stack->len > STATS.max_stack_depth)
+        STATS.max_stack_depth = stack->len;
+#endif
 }
 
 void lexer_stack_pop(regional_lexer_stack_t *stack)
@@ -808,26 +1507,140 @@ regional_lexer_t *lexer_stack_top(regional_lexer_stack_t *stack)
     return stack->lexers[stack->len - 1];
 }
 
+/* Result of a previously evaluated #if or #elif condition, keyed by its raw
+ * text and valid as long as every name it looked up is still at the same
+ * macro generation, 0 for a name that is not defined. Names are kept as
+ * symbol ids, so undefined ones need no macro table entry. */
+typedef struct {
+    char *text;
+    int len;
+    int hash;
+    int deps[MAX_COND_DEPS];
+    int dep_generations[MAX_COND_DEPS];
+    int deps_len;
+    bool value;
+} cond_cache_t;
+
+/* Resolution of an #include header name, file_idx is -1 if it cannot be
+ * found. Key is the name behind `<`, or behind `"` and the directory of the
+ * includer for quoted names, which depend on where they are included from. */
+typedef struct {
+    char *key;
+    int len;
+    int hash;
+    int file_idx;
+    int source_len;
+    /* file_cache_epoch of the resolution */
+    int epoch;
+} include_cache_t;
+
+/* Tokens a pipelined lexer produced ahead of its consumer, a single producer
+ * single consumer ring. Indices only grow, slots are indexed modulo
+ * LEXER_RING_SIZE. Shared fields are only accessed through shepherd_load and
+ * shepherd_store, never under the shepherd lock. Both threads touch the ring
+ * for every token, so the consumer's own fields and the shared ones are kept
+ * on cache lines of their own. */
+typedef struct {
+    /* Consumer's own: tokens handed out, how many it knows are produced, and
+     * the current one */
+    int read;
+    int seen;
+    token_t *token;
+    bool started;
+    char consumer_pad[LEXER_CACHE_LINE];
+    /* Shared: tokens released by the consumer and published by the
+     * producer, and whether lexer_free asked the producer to stop and it
+     * did */
+    int head;
+    int tail;
+    int stop;
+    int done;
+    char shared_pad[LEXER_CACHE_LINE];
+    token_t slots[LEXER_RING_SIZE];
+} lexer_ring_t;
+
 typedef struct {
     token_arena_t *arena;
     regional_lexer_t *global_lexer;
     regional_lexer_stack_t *regional_lexers;
+    cond_cache_t *cond_cache;
+    include_cache_t *include_cache;
+    macro_table_t *macros;
+    /* File indices of every #include taken, in order */
+    int *includes;
+    int includes_len;
+    int includes_capacity;
+    /* Spacing and source location of the current token, tokens of a macro
+     * expansion report where the outermost macro name was */
+    int cur_flags;
+    location_t cur_loc;
+    bool expansion_pending;
+    int expansion_flags;
+    location_t expansion_loc;
+    /* Owned token array if tokens are replayed from a dump, see
+     * lexer_load_dump */
+    token_t *replay;
+    /* Errors are fatal unless set, see lexer_collect_diagnostics */
+    diagnostics_t *diags;
+    bool kinds_only;
+    /* NULL unless pipelined, see lexer_enable_pipeline */
+    lexer_ring_t *ring;
 } lexer_t;
 
-lexer_t *lexer_init(char *entry_file_path)
+/* Creates lexer context over macros, which it takes ownership of. A NULL
+ * entry_file_path creates a context without input, which only serves as a
+ * base for lexer_fork. */
+lexer_t *lexer_create(char *entry_file_path, macro_table_t *macros)
 {
-    char *source;
-    int length;
-    int file_idx = file_map_add_entry(entry_file_path, &source, &length);
-
     lexer_t *lexer = malloc(sizeof(lexer_t));
     lexer->arena = arena_init(1024);
-    lexer->global_lexer =
-        reg_lexer_source_init(lexer->arena, source, length, file_idx);
+    lexer->global_lexer = NULL;
     lexer->regional_lexers = lexer_stack_init();
+    lexer->cond_cache =
+        mem_calloc(MEM_interning, COND_CACHE_SIZE * sizeof(cond_cache_t));
+    lexer->include_cache = mem_calloc(
+        MEM_interning, INCLUDE_CACHE_SIZE * sizeof(include_cache_t));
+    lexer->macros = macros;
+    lexer->includes = NULL;
+    lexer->includes_len = 0;
+    lexer->includes_capacity = 0;
+    lexer->cur_flags = 0;
+    lexer->expansion_pending = false;
+    lexer->replay = NULL;
+    lexer->diags = NULL;
+    lexer->kinds_only = false;
+    lexer->ring = NULL;
+
+    if (entry_file_path) {
+        char *source;
+        int length;
+        int file_idx = file_map_add_entry(entry_file_path, &source, &length);
+
+#ifdef SHEPHERD_THREADS
+        if (PREFETCH_INCLUDES)
+            file_prefetch_includes(file_idx);
+#endif
+        lexer->global_lexer =
+            reg_lexer_source_init(lexer->arena, source, length, file_idx);
+    }
+
     return lexer;
 }
 
+lexer_t *lexer_init(char *entry_file_path)
+{
+    return lexer_create(entry_file_path, macro_table_init());
+}
+
+/* Creates lexer context for entry_file_path that starts with the macros
+ * defined in lexer so far, e.g. by a shared prelude. The macro table is
+ * forked in constant time, each fork only pays for the macros it defines or
+ * undefines afterwards. */
+lexer_t *lexer_fork(lexer_t *lexer, char *entry_file_path)
+{
+    return lexer_create(entry_file_path, macro_table_fork(lexer->macros));
+}
+
 regional_lexer_t *lexer_top_reg_lexer(lexer_t *lexer)
 {
     regional_lexer_t *reg_lexer = lexer_stack_top(lexer->regional_lexers);
@@ -837,23 +1650,60 @@ regional_lexer_t *lexer_top_reg_lexer(lexer_t *lexer)
 
 token_t *lexer_cur_token(lexer_t *lexer)
 {
-    regional_lexer_t *reg_lexer = lexer_top_reg_lexer(lexer);
+    if (lexer->ring)
+        return lexer->ring->token;
 
-    return reg_lexer->cur_token;
+    return lexer_top_reg_lexer(lexer)->cur_token;
 }
 
 token_type_t lexer_cur_token_type(lexer_t *lexer)
 {
-    regional_lexer_t *reg_lexer = lexer_top_reg_lexer(lexer);
+    token_t *token = lexer_cur_token(lexer);
 
-    return reg_lexer->cur_token ? reg_lexer->cur_token->typ : T_eof;
+    return token ? token->typ : T_eof;
 }
 
 char *lexer_cur_token_literal(lexer_t *lexer)
 {
-    regional_lexer_t *reg_lexer = lexer_top_reg_lexer(lexer);
+    token_t *token = lexer_cur_token(lexer);
 
-    return reg_lexer->cur_token ? reg_lexer->cur_token->literal : NULL;
+    return token ? token_literal(token) : NULL;
+}
+
+/* Identifier hash computed by the scanner, symbol tables downstream can key on
+ * it instead of rehashing the spelling. */
+int lexer_cur_token_hash(lexer_t *lexer)
+{
+    token_t *token = lexer_cur_token(lexer);
+
+    return token ? token->hash : 0;
+}
+
+/* Symbol id of current token if it is an identifier, -1 otherwise. Equal
+ * spellings share an id across the whole run, so symbol tables downstream can
+ * key on it and compare identifiers as integers, see symbol_name. */
+int lexer_cur_token_symbol(lexer_t *lexer)
+{
+    token_t *token = lexer_cur_token(lexer);
+
+    return token ? token->symbol : -1;
+}
+
+/* TK_* flags of current token */
+int lexer_cur_token_flags(lexer_t *lexer)
+{
+    if (lexer->ring && lexer->ring->token)
+        return lexer->ring->token->flags;
+
+    return lexer->cur_flags;
+}
+
+location_t *lexer_cur_token_loc(lexer_t *lexer)
+{
+    if (lexer->ring && lexer->ring->token)
+        return &lexer->ring->token->loc;
+
+    return &lexer->cur_loc;
 }
 
 token_type_t lexer_next_token(lexer_t *lexer);
@@ -870,9 +1720,17 @@ bool lexer_accept_token(lexer_t *lexer, token_type_t typ)
 
 bool lexer_peek_token(lexer_t *lexer, token_type_t typ, char *buf)
 {
-    regional_lexer_t *reg_lexer = lexer_top_reg_lexer(lexer);
+    token_t *token = lexer_cur_token(lexer);
 
-    return reg_lexer_peek_token(reg_lexer, typ, buf);
+    if (!token)
+        error("Lexer is not initialized", NULL);
+
+    if (token->typ != typ)
+        return false;
+
+    if (buf)
+        strcpy(buf, token_literal(token));
+    return true;
 }
 
 void lexer_expect_token(lexer_t *lexer, token_type_t typ)
@@ -887,70 +1745,873 @@ void lexer_expect_token(lexer_t *lexer, token_type_t typ)
     return false;
 }
 
-token_t *lexer_read_alias_macro(lexer_t *lexer, regional_lexer_t *reg_lexer)
+/* Reads replacement list of an object-like macro, tokens are copied into the
+ * macro arena right after the name token, so name and body end up in a single
+ * contiguous array. */
+void lexer_read_alias_macro(lexer_t *lexer,
+                            regional_lexer_t *reg_lexer,
+                            macro_t *macro)
 {
-    token_t *token = reg_lexer->cur_token, *cur = token;
-    reg_lexer->inside_macro = true;
+    token_t *tokens = macro->name;
+    int len = 1;
 
-    while (!reg_lexer_accept_token(reg_lexer, T_eof)) {
+    while (!reg_lexer_peek_token(reg_lexer, T_eof, NULL)) {
         if (reg_lexer_peek_token(reg_lexer, T_newline, NULL))
             break;
 
-        if (reg_lexer_accept_token(reg_lexer, T_backslash)) {
-            if (!reg_lexer_accept_token(reg_lexer, T_newline))
-                error("Expected newline after backslash",
-                      &reg_lexer->cur_token->loc);
+        tokens = macro_tokens_append(tokens, len++, reg_lexer->cur_token);
+        reg_lexer_next_token(reg_lexer);
+    }
+
+    macro->name = tokens;
+    macro->replacement = tokens + 1;
+    macro->replacement_len = len - 1;
+}
+
+/* Single operand or operator of a preprocessor condition, operands are
+ * reduced to T_numeric terms while the condition is read. */
+typedef struct {
+    token_type_t typ;
+    int value;
+} cond_term_t;
+
+typedef struct {
+    cond_term_t terms[MAX_COND_TERMS];
+    int len;
+    int pos;
+    /* > 0 while evaluating an operand whose value is discarded, e.g. right
+     * hand side of a short-circuited && */
+    int unevaluated;
+    location_t loc;
+    /* Names looked up while reading, along with their generations */
+    int deps[MAX_COND_DEPS];
+    int dep_generations[MAX_COND_DEPS];
+    int deps_len;
+    bool cacheable;
+    /* Whether an error was reported, the condition is false then */
+    bool failed;
+    /* Replacement lists being expanded inside the condition */
+    regional_lexer_t *line;
+    regional_lexer_t *lexers[MAX_REGIONAL_LEXERS_SIZE];
+    int macros[MAX_REGIONAL_LEXERS_SIZE];
+    int depth;
+} cond_expr_t;
+
+/* Reports the first error of a condition only, later ones tend to follow
+ * from it */
+void cond_error(cond_expr_t *expr, char *message)
+{
+    if (!expr->failed)
+        error(message, &expr->loc);
+    expr->failed = true;
+    expr->cacheable = false;
+}
+
+/* Generation of the macro named by symbol in table, 0 if it is not defined */
+int cond_dep_generation(macro_table_t *table, int symbol)
+{
+    int idx = macro_table_find(table, symbol, symbol_hash(symbol));
+    macro_t *macro;
+
+    if (idx == -1)
+        return 0;
+
+    macro = macro_table_get(table, idx);
+    return macro->defined ? macro->generation : 0;
+}
+
+/* Looks up the macro named by token and records it as a dependency of the
+ * condition, undefined names are recorded too since defining them later
+ * changes the result. Returns index of the macro, or -1 if it is undefined or
+ * already being expanded. */
+int cond_lookup_macro(lexer_t *lexer, cond_expr_t *expr, token_t *token)
+{
+    int idx = lookup_macro(lexer->macros, token, false);
+    macro_t *macro = idx != -1 ? macro_table_get(lexer->macros, idx) : NULL;
+
+    /* Keywords have no symbol, they can never be defined */
+    if (token->symbol == -1)
+        return -1;
+
+    if (macro && !macro->defined)
+        idx = -1;
+
+    if (expr->deps_len < MAX_COND_DEPS) {
+        expr->deps[expr->deps_len] = token->symbol;
+        expr->dep_generations[expr->deps_len++] =
+            idx != -1 ? macro->generation : 0;
+    } else {
+        expr->cacheable = false;
+    }
+
+    /* Expanding macros are tracked here rather than flagged on the entry,
+     * which may be shared with forked tables */
+    for (int i = 0; i < expr->depth; i++)
+        if (expr->macros[i] == idx)
+            return -1;
+
+    return idx;
+}
+
+/* Fetches next token of the condition, a macro name is replaced by its
+ * replacement list if expand is true. Returns NULL at the end of line. */
+token_t *cond_next_token(lexer_t *lexer, cond_expr_t *expr, bool expand)
+{
+    while (true) {
+        regional_lexer_t *top =
+            expr->depth ? expr->lexers[expr->depth - 1] : expr->line;
+        token_t *token;
+
+        reg_lexer_next_token(top);
+        token = top->cur_token;
+
+        if (token->typ == T_eof && expr->depth) {
+            expr->depth--;
+            reg_lexer_free(top);
             continue;
         }
 
-        cur->next = reg_lexer->cur_token;
-        cur = cur->next;
+        if (token->typ == T_newline || token->typ == T_eof)
+            return NULL;
+
+        if (expand && token->typ == T_identifier &&
+            expr->depth < MAX_REGIONAL_LEXERS_SIZE) {
+            int idx = cond_lookup_macro(lexer, expr, token);
+
+            if (idx != -1) {
+                macro_t *macro = macro_table_get(lexer->macros, idx);
+
+                expr->macros[expr->depth] = idx;
+                expr->lexers[expr->depth++] = reg_lexer_token_init(
+                    lexer->arena, macro->replacement, macro->replacement_len,
+                    top->file_idx);
+                continue;
+            }
+        }
+
+        return token;
+    }
+}
+
+/* Reads rest of the directive line into terms, expanding macros and resolving
+ * defined operators along the way. */
+void cond_read_terms(lexer_t *lexer, cond_expr_t *expr)
+{
+    token_t *token;
+
+    while ((token = cond_next_token(lexer, expr, true))) {
+        cond_term_t *term;
+
+        if (expr->len >= MAX_COND_TERMS) {
+            cond_error(expr, "Preprocessor condition is too long");
+            continue;
+        }
+
+        term = &expr->terms[expr->len++];
+        term->typ = token->typ;
+        term->value = 0;
+
+        if (token->typ == T_numeric) {
+            if (token->num_flags & NUM_FLOAT)
+                cond_error(expr,
+                           "Floating constant in preprocessor condition");
+            if (token->num_flags & NUM_INVALID)
+                cond_error(expr,
+                           "Invalid integer constant in preprocessor condition");
+            term->value = token->value;
+        } else if (token->typ == T_char) {
+            term->typ = T_numeric;
+            term->value = token->value;
+        } else if (!strcmp(token->literal, "defined")) {
+            bool bracket;
+
+            token = cond_next_token(lexer, expr, false);
+            bracket = token && token->typ == T_open_bracket;
+            if (bracket)
+                token = cond_next_token(lexer, expr, false);
+
+            term->typ = T_numeric;
+
+            if (!token || !is_identifier_start(token->literal[0])) {
+                cond_error(expr, "Expected macro name after defined");
+                if (!token)
+                    break;
+                continue;
+            }
+
+            term->value = cond_lookup_macro(lexer, expr, token) != -1;
+
+            if (bracket) {
+                token = cond_next_token(lexer, expr, false);
+                if (!token || token->typ != T_close_bracket)
+                    cond_error(expr, "Expected ')' after defined operand");
+                if (!token)
+                    break;
+            }
+        } else if (is_identifier_start(token->literal[0])) {
+            /* Identifiers left after expansion evaluate to 0 */
+            term->typ = T_numeric;
+        }
+    }
+}
+
+token_type_t cond_peek(cond_expr_t *expr)
+{
+    return expr->pos < expr->len ? expr->terms[expr->pos].typ : T_eof;
+}
+
+/* Binding power of binary operators, 0 if typ is not a binary operator */
+int cond_precedence(token_type_t typ)
+{
+    switch (typ) {
+    case T_log_or:
+        return 1;
+    case T_log_and:
+        return 2;
+    case T_bit_or:
+        return 3;
+    case T_bit_xor:
+        return 4;
+    case T_ampersand:
+        return 5;
+    case T_eq:
+    case T_noteq:
+        return 6;
+    case T_lt:
+    case T_le:
+    case T_gt:
+    case T_ge:
+        return 7;
+    case T_lshift:
+    case T_rshift:
+        return 8;
+    case T_plus:
+    case T_minus:
+        return 9;
+    case T_asterisk:
+    case T_divide:
+    case T_mod:
+        return 10;
+    default:
+        return 0;
+    }
+}
+
+int cond_eval_ternary(cond_expr_t *expr);
+
+int cond_eval_unary(cond_expr_t *expr)
+{
+    token_type_t typ = cond_peek(expr);
+    int value;
+
+    if (typ == T_eof) {
+        cond_error(expr, "Expected expression in preprocessor condition");
+        return 0;
+    }
+
+    value = expr->terms[expr->pos++].value;
+
+    switch (typ) {
+    case T_numeric:
+        return value;
+    case T_open_bracket:
+        value = cond_eval_ternary(expr);
+        if (cond_peek(expr) != T_close_bracket)
+            cond_error(expr, "Expected ')' in preprocessor condition");
+        expr->pos++;
+        return value;
+    case T_plus:
+        return cond_eval_unary(expr);
+    case T_minus:
+        return -cond_eval_unary(expr);
+    case T_log_not:
+        return !cond_eval_unary(expr);
+    case T_bit_not:
+        return ~cond_eval_unary(expr);
+    default:
+        break;
+    }
+
+    cond_error(expr, "Unexpected token in preprocessor condition");
+    return 0;
+}
+
+int cond_eval_binary(cond_expr_t *expr, int min_precedence)
+{
+    int lhs = cond_eval_unary(expr);
+
+    while (true) {
+        token_type_t typ = cond_peek(expr);
+        int precedence = cond_precedence(typ), rhs;
+        bool short_circuit;
+
+        if (!precedence || precedence < min_precedence)
+            return lhs;
+
+        expr->pos++;
+        short_circuit = (typ == T_log_and && !lhs) || (typ == T_log_or && lhs);
+        if (short_circuit)
+            expr->unevaluated++;
+        rhs = cond_eval_binary(expr, precedence + 1);
+        if (short_circuit)
+            expr->unevaluated--;
+
+        if ((typ == T_divide || typ == T_mod) && !rhs) {
+            if (!expr->unevaluated)
+                cond_error(expr, "Division by zero in preprocessor condition");
+            lhs = 0;
+            continue;
+        }
+
+        switch (typ) {
+        case T_log_or:
+            lhs = lhs || rhs;
+            break;
+        case T_log_and:
+            lhs = lhs && rhs;
+            break;
+        case T_bit_or:
+            lhs = lhs | rhs;
+            break;
+        case T_bit_xor:
+            lhs = lhs ^ rhs;
+            break;
+        case T_ampersand:
+            lhs = lhs & rhs;
+            break;
+        case T_eq:
+            lhs = lhs == rhs;
+            break;
+        case T_noteq:
+            lhs = lhs != rhs;
+            break;
+        case T_lt:
+            lhs = lhs < rhs;
+            break;
+        case T_le:
+            lhs = lhs <= rhs;
+            break;
+        case T_gt:
+            lhs = lhs > rhs;
+            break;
+        case T_ge:
+            lhs = lhs >= rhs;
+            break;
+        case T_lshift:
+            lhs = lhs << rhs;
+            break;
+        case T_rshift:
+            lhs = lhs >> rhs;
+            break;
+        case T_plus:
+            lhs = lhs + rhs;
+            break;
+        case T_minus:
+            lhs = lhs - rhs;
+            break;
+        case T_asterisk:
+            lhs = lhs * rhs;
+            break;
+        case T_divide:
+            lhs = lhs / rhs;
+            break;
+        case T_mod:
+            lhs = lhs % rhs;
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+int cond_eval_ternary(cond_expr_t *expr)
+{
+    int cond = cond_eval_binary(expr, 1), lhs, rhs;
+
+    if (cond_peek(expr) != T_question)
+        return cond;
+
+    expr->pos++;
+    if (!cond)
+        expr->unevaluated++;
+    lhs = cond_eval_ternary(expr);
+    if (!cond)
+        expr->unevaluated--;
+
+    if (cond_peek(expr) != T_colon)
+        cond_error(expr, "Expected ':' in preprocessor condition");
+
+    expr->pos++;
+    if (cond)
+        expr->unevaluated++;
+    rhs = cond_eval_ternary(expr);
+    if (cond)
+        expr->unevaluated--;
+
+    return cond ? lhs : rhs;
+}
+
+/* Evaluates condition of #if or #elif, reg_lexer must be positioned right
+ * after the directive name and is left at the end of the directive line.
+ * Conditions only depend on the macro table, so a result is reused for the
+ * same text as long as none of the names it looked up changed since. */
+bool lexer_eval_condition(lexer_t *lexer, regional_lexer_t *reg_lexer)
+{
+    char *text = reg_lexer->source + reg_lexer->pos;
+    int len = 0, lines = 0, line_start = 0, hash = HASH_SEED, splice, i;
+    bool cacheable = true, hit = false;
+    cond_cache_t *entry;
+    cond_expr_t *expr;
+    bool value;
+
+    /* Measures raw condition text up to the unescaped end of line */
+    while (reg_lexer->pos + len < reg_lexer->source_len &&
+           !is_newline(text[len])) {
+        if ((splice = splice_len(text + len))) {
+            for (i = 0; i < splice; i++)
+                hash = ((hash << 5) + hash + text[len + i]) & HASH_MASK;
+            len += splice;
+            lines++;
+            line_start = len;
+            continue;
+        }
+        if (text[len] == '/' && text[len + 1] == '*') {
+            /* Block comments may hide newlines, leave them to the lexer */
+            cacheable = false;
+        }
+
+        hash = ((hash << 5) + hash + text[len]) & HASH_MASK;
+        len++;
+    }
+
+    entry = &lexer->cond_cache[hash & (COND_CACHE_SIZE - 1)];
+
+    if (cacheable && entry->text && entry->hash == hash &&
+        entry->len == len && !strncmp(entry->text, text, len)) {
+        for (i = 0; i < entry->deps_len; i++)
+            if (cond_dep_generation(lexer->macros, entry->deps[i]) !=
+                entry->dep_generations[i])
+                break;
+        hit = i == entry->deps_len;
+    }
+
+    if (hit) {
+        reg_lexer->pos += len;
+        reg_lexer->line += lines;
+        reg_lexer->col = lines ? len - line_start + 1 : reg_lexer->col + len;
         reg_lexer_next_token(reg_lexer);
+        return entry->value;
     }
 
-    cur->next = NULL;
-    cur = token;
-    reg_lexer->inside_macro = false;
+    expr = malloc(sizeof(cond_expr_t));
+    expr->len = 0;
+    expr->pos = 0;
+    expr->unevaluated = 0;
+    expr->line = reg_lexer;
+    expr->depth = 0;
+    expr->deps_len = 0;
+    expr->cacheable = cacheable;
+    expr->failed = false;
+    reg_lexer_cur_loc(reg_lexer, &expr->loc);
+
+    cond_read_terms(lexer, expr);
+
+    if (!expr->len)
+        cond_error(expr, "Expected expression in preprocessor condition");
+
+    value = cond_eval_ternary(expr) != 0;
+
+    if (expr->pos < expr->len)
+        cond_error(expr, "Missing binary operator in preprocessor condition");
+
+    /* A condition in error counts as false */
+    if (expr->failed)
+        value = false;
+
+    if (expr->cacheable) {
+        mem_free(MEM_interning, entry->text, entry->len + 1);
+        entry->text = mem_alloc(MEM_interning, len + 1);
+        strncpy(entry->text, text, len);
+        entry->text[len] = '\0';
+        entry->len = len;
+        entry->hash = hash;
+        entry->deps_len = expr->deps_len;
+        entry->value = value;
+
+        for (i = 0; i < expr->deps_len; i++) {
+            entry->deps[i] = expr->deps[i];
+            entry->dep_generations[i] = expr->dep_generations[i];
+        }
+    }
 
-    return token;
+    free(expr);
+
+    return value;
+}
+
+/* Maps directive name to its token type, T_eof if it is not a directive */
+token_type_t lexer_directive_type(token_t *token)
+{
+    char *name = token->literal;
+
+    if (!strcmp(name, "define"))
+        return T_cppd_define;
+    if (!strcmp(name, "undef"))
+        return T_cppd_undef;
+    if (!strcmp(name, "include"))
+        return T_cppd_include;
+    if (!strcmp(name, "error"))
+        return T_cppd_error;
+    if (!strcmp(name, "if"))
+        return T_cppd_if;
+    if (!strcmp(name, "elif"))
+        return T_cppd_elif;
+    if (!strcmp(name, "else"))
+        return T_cppd_else;
+    if (!strcmp(name, "endif"))
+        return T_cppd_endif;
+    if (!strcmp(name, "ifdef"))
+        return T_cppd_ifdef;
+    if (!strcmp(name, "ifndef"))
+        return T_cppd_ifndef;
+
+    return T_eof;
+}
+
+/* Consumes remaining tokens of the directive line */
+void lexer_skip_directive_line(regional_lexer_t *reg_lexer)
+{
+    while (!reg_lexer_peek_token(reg_lexer, T_newline, NULL) &&
+           !reg_lexer_peek_token(reg_lexer, T_eof, NULL))
+        reg_lexer_next_token(reg_lexer);
+}
+
+/* Innermost conditional of reg_lexer, NULL after reporting if there is none */
+cond_frame_t *lexer_cond_top(regional_lexer_t *reg_lexer, token_t *directive)
+{
+    if (!reg_lexer->conds_len) {
+        error("#%s without #if", &directive->loc, directive->literal);
+        return NULL;
+    }
+
+    return &reg_lexer->conds[reg_lexer->conds_len - 1];
+}
+
+/* Resolves header name of #include from file includer_idx, a header included
+ * again from the same directory costs one lookup and no syscall. Returns file
+ * map index of the header or -1 if it cannot be found. */
+int lexer_find_include(lexer_t *lexer,
+                       int includer_idx,
+                       char *name,
+                       bool quoted,
+                       int *len_ref)
+{
+    char *dir = FILE_NAMES[includer_idx], *key;
+    int dir_len = quoted && name[0] != '/' ? file_dir_len(dir) : 0;
+    int name_len = strlen(name), hash = HASH_SEED;
+    include_cache_t *entry;
+
+#ifdef SHEPHERD_STATS
+    STATS.include_lookups++;
+#endif
+    hash = ((hash << 5) + hash + (dir_len ? '"' : '<')) & HASH_MASK;
+    for (int i = 0; i < dir_len; i++)
+        hash = ((hash << 5) + hash + dir[i]) & HASH_MASK;
+    for (int i = 0; i < name_len; i++)
+        hash = ((hash << 5) + hash + name[i]) & HASH_MASK;
+
+    entry = &lexer->include_cache[hash & (INCLUDE_CACHE_SIZE - 1)];
+    key = entry->key;
+
+    if (key && entry->hash == hash && entry->epoch == file_cache_epoch &&
+        entry->len == dir_len + name_len + 1 &&
+        key[0] == (dir_len ? '"' : '<') && !strncmp(key + 1, dir, dir_len) &&
+        !strcmp(key + 1 + dir_len, name)) {
+#ifdef SHEPHERD_STATS
+        STATS.include_cache_hits++;
+#endif
+        len_ref[0] = entry->source_len;
+        return entry->file_idx;
+    }
+
+    mem_free(MEM_interning, key, entry->len + 1);
+    entry->len = dir_len + name_len + 1;
+    entry->key = mem_alloc(MEM_interning, entry->len + 1);
+    entry->key[0] = dir_len ? '"' : '<';
+    strncpy(entry->key + 1, dir, dir_len);
+    strcpy(entry->key + 1 + dir_len, name);
+    entry->hash = hash;
+    entry->epoch = file_cache_epoch;
+    entry->file_idx = file_find_include(includer_idx, name, quoted, len_ref);
+    entry->source_len = len_ref[0];
+    return entry->file_idx;
+}
+
+/* Reads header name of #include and pushes a regional lexer for the header.
+ * Header names are not tokens, so they are read as raw characters. */
+void lexer_read_include(lexer_t *lexer,
+                        regional_lexer_t *reg_lexer,
+                        token_t *directive)
+{
+    char name[MAX_PATH_LEN], close, ch;
+    int len = 0, source_len, file_idx;
+    regional_lexer_t *header;
+    location_t loc;
+
+    reg_lexer_skip_white_space(reg_lexer);
+    ch = reg_lexer_peek_char(reg_lexer, 0);
+
+    /* Errors recover by dropping the directive */
+    if (ch != '"' && ch != '<') {
+        error("Expected \"FILENAME\" or <FILENAME>",
+              reg_lexer_cur_loc(reg_lexer, &loc));
+        reg_lexer_next_token(reg_lexer);
+        lexer_skip_directive_line(reg_lexer);
+        return;
+    }
+
+    close = ch == '"' ? '"' : '>';
+    reg_lexer_read_char(reg_lexer, 1);
+
+    while ((ch = reg_lexer_peek_char(reg_lexer, 0)) != close) {
+        if (!ch || is_newline(ch) || len >= MAX_PATH_LEN - 1) {
+            if (len >= MAX_PATH_LEN - 1)
+                error("Header name is too long", &directive->loc);
+            else
+                error("Missing terminating %c character", &directive->loc,
+                      close);
+            reg_lexer_next_token(reg_lexer);
+            lexer_skip_directive_line(reg_lexer);
+            return;
+        }
+
+        name[len++] = ch;
+        reg_lexer_read_char(reg_lexer, 1);
+    }
+
+    name[len] = '\0';
+    reg_lexer_read_char(reg_lexer, 1);
+    reg_lexer_next_token(reg_lexer);
+    lexer_skip_directive_line(reg_lexer);
+
+    file_idx = lexer_find_include(lexer, reg_lexer->file_idx, name,
+                                  close == '"', &source_len);
+    if (file_idx == -1) {
+        error("Cannot find include file `%s`", &directive->loc, name);
+        return;
+    }
+
+    if (lexer->regional_lexers->len + 1 >= MAX_REGIONAL_LEXERS_SIZE) {
+        error("#include nested too deeply", &directive->loc);
+        return;
+    }
+
+#ifdef SHEPHERD_THREADS
+    if (PREFETCH_INCLUDES)
+        file_prefetch_includes(file_idx);
+#endif
+
+    if (lexer->includes_len == lexer->includes_capacity) {
+        int *includes;
+
+        lexer->includes_capacity = lexer->includes_capacity * 2 + 16;
+        includes = malloc(lexer->includes_capacity * sizeof(int));
+        if (lexer->includes_len)
+            memcpy(includes, lexer->includes,
+                   lexer->includes_len * sizeof(int));
+        free(lexer->includes);
+        lexer->includes = includes;
+    }
+    lexer->includes[lexer->includes_len++] = file_idx;
+
+    header = reg_lexer_source_init(lexer->arena, FILE_SOURCES[file_idx],
+                                   source_len, file_idx);
+    header->kinds_only = lexer->kinds_only;
+    lexer_stack_push(lexer->regional_lexers, header);
+}
+
+/* Forgets every cached condition result, e.g. once the macro table is
+ * replaced by an older one */
+void lexer_clear_cond_cache(lexer_t *lexer)
+{
+    for (int i = 0; i < COND_CACHE_SIZE; i++) {
+        mem_free(MEM_interning, lexer->cond_cache[i].text,
+                 lexer->cond_cache[i].len + 1);
+        lexer->cond_cache[i].text = NULL;
+    }
 }
 
 /* Reads preprocessor directive, this action is location-sensitive. */
 void lexer_read_directive(lexer_t *lexer, regional_lexer_t *reg_lexer)
 {
-    if (!reg_lexer->after_newline)
+    /* Recovers by dropping the # */
+    if (!reg_lexer->after_newline) {
         error("Stray # in non-macro context or non-line-start position",
               &reg_lexer->cur_token->loc);
+        return;
+    }
 
+    /* Directive ends at the first unescaped newline */
+    reg_lexer->inside_macro = true;
     reg_lexer_expect_token(reg_lexer, T_cppd_hash);
 
-    if (!strcmp(reg_lexer->cur_token->literal, "define")) {
+    token_t *directive = reg_lexer->cur_token;
+    cond_frame_t *cond;
+    bool taken;
+
+    trace_begin(TRACE_DIRECTIVE, "#", directive->literal);
+
+    /* Errors in a directive recover by dropping the rest of its line */
+    switch (lexer_directive_type(directive)) {
+    case T_cppd_define: {
         macro_t *macro;
-        reg_lexer_expect_token(reg_lexer, T_identifier);
-        macro = add_macro(false);
-        macro->name = reg_lexer->cur_token;
-        reg_lexer_expect_token(reg_lexer, T_identifier);
+        reg_lexer_next_token(reg_lexer);
+        if (!reg_lexer_peek_token(reg_lexer, T_identifier, NULL)) {
+            error("Expected macro name", &reg_lexer->cur_token->loc);
+            lexer_skip_directive_line(reg_lexer);
+            break;
+        }
+        macro = define_macro(lexer->macros, reg_lexer->cur_token, false);
+        reg_lexer_next_token(reg_lexer);
 
         /* TODO: Implement function-like parser here */
-        token_t *replacement = lexer_read_alias_macro(lexer, reg_lexer);
-        macro->replacement = replacement;
-        return;
+        lexer_read_alias_macro(lexer, reg_lexer, macro);
+        break;
+    }
+    case T_cppd_include: {
+        lexer_read_include(lexer, reg_lexer, directive);
+        break;
     }
+    case T_cppd_undef: {
+        reg_lexer_next_token(reg_lexer);
+        if (!reg_lexer_peek_token(reg_lexer, T_identifier, NULL))
+            error("Expected macro name", &reg_lexer->cur_token->loc);
+        else
+            undef_macro(lexer->macros, reg_lexer->cur_token);
+        lexer_skip_directive_line(reg_lexer);
+        break;
+    }
+    case T_cppd_if:
+    case T_cppd_ifdef:
+    case T_cppd_ifndef: {
+        /* Skips the group, whose #endif then closes the enclosing one */
+        if (reg_lexer->conds_len >= MAX_COND_DEPTH) {
+            error("Conditional directives are nested too deeply",
+                  &directive->loc);
+            lexer_skip_directive_line(reg_lexer);
+            reg_lexer_skip_group(reg_lexer);
+            break;
+        }
 
+        cond = &reg_lexer->conds[reg_lexer->conds_len++];
+        memcpy(&cond->loc, &directive->loc, sizeof(location_t));
+        cond->seen_else = false;
 
-    error("Unexpected preprocessor directive `%s`", &reg_lexer->cur_token->loc,
-          reg_lexer->cur_token->literal);
+        if (directive->typ == T_if) {
+            taken = lexer_eval_condition(lexer, reg_lexer);
+        } else {
+            bool ifdef = !strcmp(directive->literal, "ifdef");
+            reg_lexer_next_token(reg_lexer);
+            if (!reg_lexer_peek_token(reg_lexer, T_identifier, NULL)) {
+                error("Expected macro name", &reg_lexer->cur_token->loc);
+                taken = false;
+            } else {
+                taken =
+                    find_macro(lexer->macros, reg_lexer->cur_token) != NULL;
+                taken = ifdef ? taken : !taken;
+            }
+            lexer_skip_directive_line(reg_lexer);
+        }
+
+        cond->taken = taken;
+        if (!taken)
+            reg_lexer_skip_group(reg_lexer);
+        break;
+    }
+    case T_cppd_elif: {
+        cond = lexer_cond_top(reg_lexer, directive);
+        if (!cond) {
+            lexer_skip_directive_line(reg_lexer);
+            break;
+        }
+        if (cond->seen_else) {
+            error("#elif after #else", &directive->loc);
+            cond->taken = true;
+        }
+
+        if (cond->taken) {
+            lexer_skip_directive_line(reg_lexer);
+            reg_lexer_skip_group(reg_lexer);
+            break;
+        }
+
+        cond->taken = lexer_eval_condition(lexer, reg_lexer);
+        if (!cond->taken)
+            reg_lexer_skip_group(reg_lexer);
+        break;
+    }
+    case T_cppd_else: {
+        cond = lexer_cond_top(reg_lexer, directive);
+        if (!cond) {
+            lexer_skip_directive_line(reg_lexer);
+            break;
+        }
+        if (cond->seen_else) {
+            error("#else after #else", &directive->loc);
+            cond->taken = true;
+        }
+
+        cond->seen_else = true;
+        lexer_skip_directive_line(reg_lexer);
+
+        if (cond->taken) {
+            reg_lexer_skip_group(reg_lexer);
+            break;
+        }
+
+        cond->taken = true;
+        break;
+    }
+    case T_cppd_endif: {
+        if (lexer_cond_top(reg_lexer, directive))
+            reg_lexer->conds_len--;
+        lexer_skip_directive_line(reg_lexer);
+        break;
+    }
+    default:
+        error("Unexpected preprocessor directive `%s`", &directive->loc,
+              directive->literal);
+        lexer_skip_directive_line(reg_lexer);
+    }
+
+    reg_lexer->inside_macro = false;
+    trace_end(TRACE_DIRECTIVE);
 }
 
 bool lexer_expand_macro(lexer_t *lexer, regional_lexer_t *reg_lexer)
 {
-    macro_t *macro = find_macro(reg_lexer->cur_token->literal);
+    macro_t *macro = find_macro(lexer->macros, reg_lexer->cur_token);
 
     if (macro) {
         if (macro->functiono_like) {
         } else {
-            regional_lexer_t *macro_lexer = reg_lexer_token_init(
-                lexer->arena, macro->replacement, reg_lexer->file_idx);
+            regional_lexer_t *macro_lexer =
+                reg_lexer_token_init(lexer->arena, macro->replacement,
+                                     macro->replacement_len, reg_lexer->file_idx);
+
+#ifdef SHEPHERD_STATS
+            STATS.expansions++;
+#endif
+
+            macro_lexer->traced = TRACE != NULL;
+            trace_begin(TRACE_MACRO, "", macro->name->literal);
+
+            if (reg_lexer->mode == LM_source) {
+                lexer->expansion_pending = true;
+                lexer->expansion_flags = reg_lexer->cur_token->flags;
+                lexer->expansion_loc = reg_lexer->cur_token->loc;
+            }
+
             lexer_stack_push(lexer->regional_lexers, macro_lexer);
             return true;
         }
@@ -959,17 +2620,95 @@ bool lexer_expand_macro(lexer_t *lexer, regional_lexer_t *reg_lexer)
     return false;
 }
 
-token_type_t lexer_next_token(lexer_t *lexer)
+/* Makes tokens of lexer outside directives record only their kind, offset
+ * and length, for consumers that look at few spellings or none at all. Their
+ * spelling is copied out of the source by token_literal, e.g. through
+ * lexer_cur_token_literal, once it is asked for. */
+void lexer_set_kinds_only(lexer_t *lexer, bool enabled)
+{
+    lexer->kinds_only = enabled;
+    if (lexer->global_lexer && lexer->global_lexer->mode == LM_source)
+        lexer->global_lexer->kinds_only = enabled;
+}
+
+/* Makes errors of lexer recoverable, each one is recorded with its location
+ * and lexing resumes right after it. Once limit errors are recorded (0 for no
+ * limit) the rest of the input is abandoned and lexer only returns T_eof. */
+void lexer_collect_diagnostics(lexer_t *lexer, int limit)
+{
+    if (!lexer->diags)
+        lexer->diags = calloc(1, sizeof(diagnostics_t));
+    lexer->diags->limit = limit;
+}
+
+/* Errors recorded so far, NULL unless lexer collects them */
+diagnostics_t *lexer_diagnostics(lexer_t *lexer)
+{
+    return lexer->diags;
+}
+
+/* Makes lexer's diagnostics sink the current one, returns false if its error
+ * limit is reached or a memory cap was exceeded, and the input was
+ * abandoned. */
+bool lexer_enter(lexer_t *lexer)
+{
+    diagnostics_t *diags = lexer->diags;
+    regional_lexer_t *global = lexer->global_lexer;
+
+    DIAGNOSTICS = diags;
+
+    /* Nothing more fits under the cap, so the input is given up */
+    if (memory_exceeded) {
+        int owner = memory_exceeded - 1;
+        location_t loc;
+
+        memory_exceeded = 0;
+        error("Memory cap of %d bytes exceeded by %s",
+              reg_lexer_cur_loc(lexer_top_reg_lexer(lexer), &loc),
+              MEMORY.owners[owner].cap, memory_owner_name(owner));
+    } else if (!diags || !diags->limit || diags->len < diags->limit)
+        return true;
+
+    while (lexer->regional_lexers->len)
+        lexer_stack_pop(lexer->regional_lexers);
+    if (global->mode == LM_source) {
+        global->pos = global->source_len;
+        global->conds_len = 0;
+        global->inside_macro = false;
+    }
+    return false;
+}
+
+/* Preprocesses and lexes the next token, the producer in pipelined mode */
+token_type_t lexer_produce_token(lexer_t *lexer)
 {
+    lexer_enter(lexer);
+
     regional_lexer_t *reg_lexer = lexer_top_reg_lexer(lexer);
     reg_lexer_next_token(reg_lexer);
     token_type_t typ = reg_lexer->cur_token->typ;
 
+    /* Replayed tokens are preprocessed already */
+    if (lexer->replay) {
+        lexer->cur_flags = reg_lexer->cur_token->flags;
+        lexer->cur_loc = reg_lexer->cur_token->loc;
+#ifdef SHEPHERD_STATS
+        STATS.tokens[typ]++;
+#endif
+        return typ;
+    }
+
     switch (typ) {
     case T_eof: {
+        if (reg_lexer->conds_len) {
+            error("Unterminated conditional directive",
+                  &reg_lexer->conds[reg_lexer->conds_len - 1].loc);
+            reg_lexer->conds_len = 0;
+        }
+
         if (lexer->regional_lexers->len) {
             lexer_stack_pop(lexer->regional_lexers);
-            return lexer_next_token(lexer);
+            return lexer_produce_token(lexer);
         }
         break;
     }
@@ -977,24 +2716,279 @@ token_type_t lexer_next_token(lexer_t *lexer)
         if (reg_lexer->mode == LM_source && !reg_lexer->inside_macro) {
             /* only suppose to be directive */
             lexer_read_directive(lexer, reg_lexer);
-            return lexer_next_token(lexer);
+            return lexer_produce_token(lexer);
         }
         break;
     }
     case T_identifier: {
         if (lexer_expand_macro(lexer, reg_lexer))
-            return lexer_next_token(lexer);
+            return lexer_produce_token(lexer);
         break;
     }
     default:
         break;
     }
 
+    /* First token of an expansion is spaced like the macro name it replaces */
+    if (reg_lexer->mode == LM_source) {
+        lexer->cur_flags = reg_lexer->cur_token->flags;
+        lexer->cur_loc = reg_lexer->cur_token->loc;
+        lexer->expansion_pending = false;
+    } else {
+        lexer->cur_flags = lexer->expansion_pending
+                               ? lexer->expansion_flags
+                               : reg_lexer->cur_token->flags & TK_LEADING_SPACE;
+        lexer->cur_flags |= TK_EXPANDED;
+        lexer->cur_loc = lexer->expansion_loc;
+        lexer->expansion_pending = false;
+    }
+
+#ifdef SHEPHERD_STATS
+    STATS.tokens[typ]++;
+#endif
+
     return typ;
 }
 
+#ifdef SHEPHERD_THREADS
+/* Produces the next token into slot, with the spacing and location the
+ * consumer will read. Spellings read lazily are spelled here, and string
+ * contents are moved to string storage, as the consumer can not read the file
+ * map safely while the producer grows it. */
+token_type_t lexer_ring_put(lexer_t *lexer, token_t *token)
+{
+    token_type_t typ = lexer_produce_token(lexer);
+    token_t *src = lexer_top_reg_lexer(lexer)->cur_token;
+
+    if (typ == T_string)
+        token_string_detach(src);
+
+    token->loc = lexer->cur_loc;
+    token->typ = typ;
+    token->hash = src->hash;
+    token->flags = lexer->cur_flags;
+    token->str = src->str;
+    token->str_len = src->str_len;
+    token->value = src->value;
+    token->num_flags = src->num_flags;
+    token->symbol = src->symbol;
+    token->len = src->len;
+    strcpy(token->literal, token_literal(src));
+    token->next = NULL;
+    return typ;
+}
+
+/* Body of the producer thread of a pipelined lexer, lexes until T_eof or
+ * until lexer_free stops it. Produced tokens are published every
+ * LEXER_RING_SYNC of them, and it waits while the ring is full. */
+void lexer_ring_producer(void *arg)
+{
+    lexer_t *lexer = arg;
+    lexer_ring_t *ring = lexer->ring;
+    int tail = 0, limit = 0;
+    bool eof = false, stop = false;
+
+    while (!eof) {
+        if (tail == limit || !(tail % LEXER_RING_SYNC)) {
+            shepherd_store(&ring->tail, tail);
+            while (tail - shepherd_load(&ring->head) == LEXER_RING_SIZE &&
+                   !shepherd_load(&ring->stop))
+                shepherd_yield();
+            limit = shepherd_load(&ring->head) + LEXER_RING_SIZE;
+            stop = shepherd_load(&ring->stop);
+
+            if (stop)
+                break;
+        }
+
+        eof = lexer_ring_put(lexer,
+                             &ring->slots[tail & (LEXER_RING_SIZE - 1)]) ==
+              T_eof;
+        tail++;
+    }
+
+    shepherd_store(&ring->tail, tail);
+    shepherd_store(&ring->done, true);
+}
+
+/* Consumer side, takes the next token out of the ring. Consumed slots are
+ * released every LEXER_RING_SYNC tokens, or when it runs dry and waits. */
+token_type_t lexer_ring_next(lexer_t *lexer)
+{
+    lexer_ring_t *ring = lexer->ring;
+    token_t *token = ring->token;
+
+    if (!ring->started) {
+        ring->started = true;
+        shepherd_thread_start(lexer_ring_producer, lexer);
+    }
+
+    if (token && token->typ == T_eof)
+        return T_eof;
+
+    /* Slot of the previous token is only released now */
+    if (token)
+        ring->read++;
+    if (ring->read == ring->seen || !(ring->read % LEXER_RING_SYNC)) {
+        shepherd_store(&ring->head, ring->read);
+        while ((ring->seen = shepherd_load(&ring->tail)) == ring->read)
+            shepherd_yield();
+    }
+
+    token = &ring->slots[ring->read & (LEXER_RING_SIZE - 1)];
+    ring->token = token;
+    return token->typ;
+}
+#endif
+
+/* Makes lexer produce tokens on a thread of its own, ahead of its consumer,
+ * into a bounded ring of LEXER_RING_SIZE slots, so preprocessing overlaps
+ * with whatever the consumer does with each token. Tokens are still consumed
+ * through lexer_next_token and the lexer_cur_token accessors; the consumer
+ * must not call anything else that lexes or allocates through the lexer
+ * meanwhile, while file_name and symbol_name are safe. The producer starts
+ * with the first token. Errors are reported as tokens are produced, up to a
+ * ring ahead of the token being consumed.
+ * Returns false and leaves lexer as it is once a token was read, or in builds
+ * without SHEPHERD_THREADS (see bench/host.h), such as shecc's. */
+bool lexer_enable_pipeline(lexer_t *lexer)
+{
+#ifdef SHEPHERD_THREADS
+    if (lexer->ring)
+        return true;
+    if (!lexer->global_lexer || lexer_top_reg_lexer(lexer)->cur_token)
+        return false;
+
+    lexer->ring = mem_alloc(MEM_arena, sizeof(lexer_ring_t));
+    lexer->ring->read = 0;
+    lexer->ring->seen = 0;
+    lexer->ring->token = NULL;
+    lexer->ring->started = false;
+    lexer->ring->head = 0;
+    lexer->ring->tail = 0;
+    lexer->ring->stop = false;
+    lexer->ring->done = false;
+    return true;
+#else
+    return false;
+#endif
+}
+
+token_type_t lexer_next_token(lexer_t *lexer)
+{
+#ifdef SHEPHERD_THREADS
+    if (lexer->ring)
+        return lexer_ring_next(lexer);
+#endif
+    return lexer_produce_token(lexer);
+}
+
+/* Push mode, drives the whole lexer and hands tokens to sink in batches of
+ * up to LEXER_BATCH_SIZE, or larger ones while sink asks for lookahead.
+ * Returns true if sink stopped it, false once T_eof was delivered. */
+bool lexer_run(lexer_t *lexer, token_sink_t sink, void *user)
+{
+    int capacity = LEXER_BATCH_SIZE, len = 0;
+    token_t *batch = malloc(capacity * sizeof(token_t));
+    token_sink_result_t result = TS_continue;
+    bool eof = false;
+
+    while (!eof) {
+        token_t *token;
+
+        eof = lexer_next_token(lexer) == T_eof;
+
+        if (len == capacity) {
+            token_t *grown = malloc(capacity * 2 * sizeof(token_t));
+
+            memcpy(grown, batch, len * sizeof(token_t));
+            free(batch);
+            batch = grown;
+            capacity *= 2;
+        }
+
+        token = &batch[len++];
+        memcpy(token, lexer_cur_token(lexer), sizeof(token_t));
+        token->flags = lexer_cur_token_flags(lexer);
+        token->loc = lexer_cur_token_loc(lexer)[0];
+        token->next = NULL;
+
+        /* Lookahead keeps growing the batch until sink takes it */
+        if (eof || len % LEXER_BATCH_SIZE == 0) {
+            result = sink(batch, len, user);
+
+            if (result == TS_stop)
+                break;
+            if (result == TS_continue)
+                len = 0;
+        }
+    }
+
+    free(batch);
+    return result == TS_stop;
+}
+
+/* Dependency scan, only directive lines are lexed and everything between them
+ * is skipped without tokenizing, while lexer->includes ends up the same as
+ * after lexing every token. */
+void lexer_scan_deps(lexer_t *lexer)
+{
+    while (lexer_enter(lexer)) {
+        regional_lexer_t *reg_lexer = lexer_top_reg_lexer(lexer);
+
+        reg_lexer_skip_to_directive(reg_lexer);
+
+        if (reg_lexer->pos >= reg_lexer->source_len) {
+            if (reg_lexer->conds_len) {
+                error("Unterminated conditional directive",
+                      &reg_lexer->conds[reg_lexer->conds_len - 1].loc);
+                reg_lexer->conds_len = 0;
+            }
+
+            if (!lexer->regional_lexers->len)
+                return;
+
+            lexer_stack_pop(lexer->regional_lexers);
+            continue;
+        }
+
+        reg_lexer_next_token(reg_lexer);
+        lexer_read_directive(lexer, reg_lexer);
+    }
+}
+
 void lexer_free(lexer_t *lexer)
 {
+#ifdef SHEPHERD_THREADS
+    /* Producer thread must be done with the context first */
+    if (lexer->ring && lexer->ring->started) {
+        shepherd_store(&lexer->ring->stop, true);
+        while (!shepherd_load(&lexer->ring->done))
+            shepherd_yield();
+    }
+#endif
+    for (int i = 0; i < COND_CACHE_SIZE; i++)
+        mem_free(MEM_interning, lexer->cond_cache[i].text,
+                 lexer->cond_cache[i].len + 1);
+    mem_free(MEM_interning, lexer->cond_cache,
+             COND_CACHE_SIZE * sizeof(cond_cache_t));
+    for (int i = 0; i < INCLUDE_CACHE_SIZE; i++)
+        mem_free(MEM_interning, lexer->include_cache[i].key,
+                 lexer->include_cache[i].len + 1);
+    mem_free(MEM_interning, lexer->include_cache,
+             INCLUDE_CACHE_SIZE * sizeof(include_cache_t));
+    macro_table_free(lexer->macros);
+    free(lexer->includes);
+    free(lexer->replay);
+    mem_free(MEM_arena, lexer->ring, sizeof(lexer_ring_t));
+    if (DIAGNOSTICS == lexer->diags)
+        DIAGNOSTICS = NULL;
+    if (lexer->diags)
+        free(lexer->diags->items);
+    free(lexer->diags);
+    while (lexer->regional_lexers->len)
+        lexer_stack_pop(lexer->regional_lexers);
+    free(lexer->regional_lexers);
     arena_free(lexer->arena);
     reg_lexer_free(lexer->global_lexer);
     free(lexer);
@@ -1,24 +1,422 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "globals.c"
+#include "trace.c"
 #include "lexer.c"
+#include "snapshot.c"
+#include "emit.c"
+#include "dump.c"
+#include "relex.c"
+#include "stats.c"
 
-int main()
+#define MAX_INPUTS 256
+#define MAX_EDITS 64
+
+#define DEPS_NONE 0
+#define DEPS_MAKE 1
+#define DEPS_JSON 2
+
+/* Whether file_idx is already among the first len includes of lexer */
+bool deps_seen(lexer_t *lexer, int len, int file_idx)
+{
+    for (int i = 0; i < len; i++)
+        if (!strcmp(FILE_NAMES[lexer->includes[i]], FILE_NAMES[file_idx]))
+            return true;
+    return false;
+}
+
+/* Prints make rule in the way of `cc -MM`, object named after input */
+void print_deps_make(char *input, lexer_t *lexer)
+{
+    char *base = input;
+    int len;
+
+    for (char *p = input; *p; p++)
+        if (*p == '/')
+            base = p + 1;
+
+    len = strlen(base);
+    while (len && base[len - 1] != '.')
+        len--;
+    if (!len)
+        len = strlen(base) + 1;
+
+    for (int i = 0; i < len - 1; i++)
+        printf("%c", base[i]);
+    printf(".o: %s", input);
+
+    for (int i = 0; i < lexer->includes_len; i++)
+        if (!deps_seen(lexer, i, lexer->includes[i]))
+            printf(" \\\n  %s", FILE_NAMES[lexer->includes[i]]);
+    printf("\n");
+}
+
+void print_json_string(char *str)
+{
+    printf("\"");
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\')
+            printf("\\%c", *str);
+        else if (*str == '\n')
+            printf("\\n");
+        else if (*str == '\t')
+            printf("\\t");
+        else
+            printf("%c", *str);
+    }
+    printf("\"");
+}
+
+void print_deps_json(char *input, lexer_t *lexer, bool first)
+{
+    bool empty = true;
+
+    printf(first ? "[\n" : ",\n");
+    printf("  {\"file\": ");
+    print_json_string(input);
+    printf(", \"includes\": [");
+
+    for (int i = 0; i < lexer->includes_len; i++) {
+        if (deps_seen(lexer, i, lexer->includes[i]))
+            continue;
+        if (!empty)
+            printf(", ");
+        print_json_string(FILE_NAMES[lexer->includes[i]]);
+        empty = false;
+    }
+    printf("]}");
+}
+
+void print_string(int *token_count, char *str, int len)
+{
+    printf("[%d]: ", token_count[0]++);
+    for (int i = 0; i < len; i++)
+        printf("%c", str[i]);
+    printf("\n");
+}
+
+token_sink_result_t print_sink(token_t *tokens, int len, void *user)
+{
+    int *token_count = user;
+
+    for (int i = 0; i < len; i++) {
+        if (tokens[i].typ == T_string)
+            print_string(token_count, token_string(&tokens[i]),
+                         tokens[i].str_len);
+        else if (tokens[i].typ != T_eof)
+            printf("[%d]: %s\n", token_count[0]++,
+                   token_literal(&tokens[i]));
+    }
+
+    return TS_continue;
+}
+
+/* Same as print_sink, with adjacent string literals listed as one */
+token_sink_result_t join_sink(token_t *tokens, int len, void *user)
+{
+    int *token_count = user;
+    int run, str_len;
+    char *str;
+
+    if (tokens[len - 1].typ == T_string)
+        return TS_lookahead;
+
+    for (int i = 0; i < len; i += run) {
+        run = string_run(tokens + i, len - i);
+        if (!run) {
+            print_sink(tokens + i, 1, user);
+            run = 1;
+            continue;
+        }
+
+        str = string_concat(tokens + i, run, &str_len);
+        print_string(token_count, str, str_len);
+    }
+
+    return TS_continue;
+}
+
+token_sink_result_t count_sink(token_t *tokens, int len, void *user)
+{
+    int *token_count = user;
+
+    token_count[0] += tokens[len - 1].typ == T_eof ? len - 1 : len;
+    return TS_continue;
+}
+
+/* Writes tokens of lexer as preprocessed text or as a numbered list, which
+ * joins adjacent string literals if join is set */
+void print_tokens(emitter_t *emitter, lexer_t *lexer, bool join)
 {
-    init_globals();
     int token_count = 0;
-    lexer_t *lexer = lexer_init("test_suite/alias.c");
-    token_type_t typ;
 
-    typ = lexer_next_token(lexer);
+    if (emitter) {
+        emit_lexer(emitter, lexer);
+        return;
+    }
+
+    lexer_run(lexer, join ? join_sink : print_sink, &token_count);
+}
+
+/* Prints errors lexer recorded, returns how many there were */
+int print_diagnostics(lexer_t *lexer)
+{
+    diagnostics_t *diags = lexer_diagnostics(lexer);
+
+    if (!diags)
+        return 0;
 
-    while (typ != T_eof) {
-        token_t *tk = lexer_cur_token(lexer);
-        printf("[%d]: %s\n", token_count++, tk->literal);
-        typ = lexer_next_token(lexer);
+    for (int i = 0; i < diags->len; i++)
+        diagnostic_print(diags->items[i].message, &diags->items[i].loc);
+    return diags->len;
+}
+
+/* Copies len bytes of an --edit argument at src to dst, turning `\n` into a
+ * newline */
+void edit_unescape(char *dst, char *src, int len)
+{
+    int j = 0;
+
+    for (int i = 0; i < len && j < MAX_LINE_LEN - 1; i++) {
+        if (src[i] == '\\' && i + 1 < len && src[i + 1] == 'n') {
+            dst[j++] = '\n';
+            i++;
+        } else
+            dst[j++] = src[i];
+    }
+    dst[j] = '\0';
+}
+
+/* Offset of the first occurrence of str in source, -1 if there is none */
+int edit_find(char *source, char *str)
+{
+    int len = strlen(str);
+
+    for (int i = 0; source[i]; i++)
+        if (!strncmp(source + i, str, len))
+            return i;
+    return -1;
+}
+
+/* Keeps the input of lexer as a token stream and applies every `--edit
+ * FROM=TO` to it in turn, each replacing the first FROM in the file. After
+ * each edit the stream must hold the same tokens as lexing the edited file
+ * from scratch. Returns the number of edits after which it did not. */
+int check_edits(char *input, lexer_t *lexer, char **edits, int edits_len)
+{
+    token_stream_t *stream = token_stream_init(lexer);
+    int failures = 0;
+
+    for (int i = 0; i < edits_len; i++) {
+        char from[MAX_LINE_LEN], to[MAX_LINE_LEN];
+        int split = 0, offset, relexed, differs;
+
+        while (edits[i][split] && edits[i][split] != '=')
+            split++;
+        edit_unescape(from, edits[i], split);
+        if (edits[i][split])
+            split++;
+        edit_unescape(to, edits[i] + split, strlen(edits[i] + split));
+
+        offset = edit_find(FILE_SOURCES[stream->file_idx], from);
+        if (!from[0] || offset < 0) {
+            printf("Error: --edit expects FROM=TO with FROM in %s, got %s\n",
+                   input, edits[i]);
+            exit(1);
+        }
+
+        relexed = token_stream_edit(stream, offset, strlen(from), to);
+        differs = token_stream_verify(stream);
+
+        printf("[%s] edit %d: %d tokens relexed, ", input, i + 1, relexed);
+        if (differs < 0) {
+            printf("same as a fresh lex\n");
+        } else {
+            printf("differs from a fresh lex at token %d\n", differs);
+            failures++;
+        }
+    }
+
+    token_stream_free(stream);
+    return failures;
+}
+
+/* Applies `--mem-cap OWNER=BYTES`, returns false if arg is malformed */
+bool parse_memory_cap(char *arg)
+{
+    for (int i = 0; i < MEM_OWNERS; i++) {
+        char *name = memory_owner_name(i);
+        int len = strlen(name);
+
+        if (!strncmp(arg, name, len) && arg[len] == '=') {
+            lexer_set_memory_cap(i, atoi(arg + len + 1));
+            return true;
+        }
+    }
+
+    return false;
+}
+
+int main(int argc, char *argv[])
+{
+    char *inputs[MAX_INPUTS], *prelude_path = NULL, *snapshot_path = NULL;
+    char *edits[MAX_EDITS];
+    int edits_len = 0;
+    char *dump_path = NULL, *replay_path = NULL, *trace_path = NULL;
+    int inputs_len = 0, deps = DEPS_NONE, max_errors = -1, errors = 0;
+    bool preprocess = false, count = false, stats = false, memory = false;
+    bool pipeline = false, join = false;
+    int token_count = 0;
+    lexer_t *prelude = NULL;
+    emitter_t *emitter = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--prelude") && i + 1 < argc)
+            prelude_path = argv[++i];
+        else if (!strcmp(argv[i], "--snapshot") && i + 1 < argc)
+            snapshot_path = argv[++i];
+        else if (!strcmp(argv[i], "--dump") && i + 1 < argc)
+            dump_path = argv[++i];
+        else if (!strcmp(argv[i], "--replay") && i + 1 < argc)
+            replay_path = argv[++i];
+        else if (!strcmp(argv[i], "--deps") || !strcmp(argv[i], "--deps=make"))
+            deps = DEPS_MAKE;
+        else if (!strcmp(argv[i], "--deps=json"))
+            deps = DEPS_JSON;
+        else if (!strcmp(argv[i], "--trace") && i + 1 < argc)
+            trace_path = argv[++i];
+        else if (!strcmp(argv[i], "--stats"))
+            stats = true;
+        else if (!strcmp(argv[i], "--memory"))
+            memory = true;
+        else if (!strcmp(argv[i], "--mem-cap") && i + 1 < argc) {
+            if (!parse_memory_cap(argv[++i])) {
+                printf("Error: --mem-cap expects OWNER=BYTES, got %s\n",
+                       argv[i]);
+                exit(1);
+            }
+        } else if (!strcmp(argv[i], "--edit") && i + 1 < argc) {
+            if (edits_len < MAX_EDITS)
+                edits[edits_len++] = argv[++i];
+        } else if (!strcmp(argv[i], "--max-errors") && i + 1 < argc)
+            max_errors = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--count"))
+            count = true;
+        else if (!strcmp(argv[i], "-E"))
+            preprocess = true;
+        else if (!strcmp(argv[i], "--join-strings"))
+            join = true;
+        else if (!strcmp(argv[i], "--pipeline"))
+            pipeline = true;
+        else if (!strcmp(argv[i], "--prefetch"))
+            set_include_prefetch(true);
+        else if (!strcmp(argv[i], "-I") && i + 1 < argc)
+            add_include_path(argv[++i]);
+        else if (argv[i][0] == '-' && argv[i][1] == 'I')
+            add_include_path(argv[i] + 2);
+        else if (inputs_len < MAX_INPUTS)
+            inputs[inputs_len++] = argv[i];
+    }
+
+    if (!inputs_len)
+        inputs[inputs_len++] = "test_suite/alias.c";
+
+    if (dump_path && inputs_len > 1) {
+        printf("Error: --dump takes a single input\n");
+        exit(1);
     }
 
-    lexer_free(lexer);
+    init_globals();
+
+    if (trace_path)
+        trace_init();
+
+    if (prelude_path)
+        prelude = lexer_load_prelude(prelude_path, snapshot_path);
+
+    if (preprocess && !deps)
+        emitter = emit_init(1);
+
+    /* Replay stands in for every input */
+    if (replay_path) {
+        lexer_t *lexer = lexer_load_dump(replay_path);
+
+        if (!lexer) {
+            printf("[%s] Error: Token dump is invalid or stale\n",
+                   replay_path);
+            exit(1);
+        }
+
+        print_tokens(emitter, lexer, join);
+        lexer_free(lexer);
+        inputs_len = 0;
+    }
+
+    /* Every input starts from the state after the prelude, which is lexed
+     * once and forked */
+    for (int i = 0; i < inputs_len; i++) {
+        lexer_t *lexer =
+            prelude ? lexer_fork(prelude, inputs[i]) : lexer_init(inputs[i]);
+
+        if (max_errors >= 0)
+            lexer_collect_diagnostics(lexer, max_errors);
+
+        /* Edits replace the output, the file is lexed once then edited */
+        if (edits_len) {
+            errors += check_edits(inputs[i], lexer, edits, edits_len);
+            errors += print_diagnostics(lexer);
+            lexer_free(lexer);
+            continue;
+        }
+
+        /* Counting never looks at a spelling */
+        lexer_set_kinds_only(lexer, count);
+        /* Dumping interns spellings and joining allocates string storage
+         * as they consume, which is not safe beside a producer thread */
+        if (pipeline && !dump_path && !join)
+            lexer_enable_pipeline(lexer);
+
+        /* Dependency output never needs tokens outside directives */
+        if (deps) {
+            lexer_scan_deps(lexer);
+            if (deps == DEPS_MAKE)
+                print_deps_make(inputs[i], lexer);
+            else
+                print_deps_json(inputs[i], lexer, !i);
+            errors += print_diagnostics(lexer);
+            lexer_free(lexer);
+            continue;
+        }
+
+        if (dump_path)
+            lexer_dump(lexer, dump_path);
+        else if (count)
+            lexer_run(lexer, count_sink, &token_count);
+        else
+            print_tokens(emitter, lexer, join);
+
+        /* Errors follow the output of their file */
+        if (emitter)
+            emit_flush(emitter);
+        errors += print_diagnostics(lexer);
+        lexer_free(lexer);
+    }
+
+    if (count)
+        printf("%d\n", token_count);
+    if (emitter)
+        emit_free(emitter);
+    if (deps == DEPS_JSON)
+        printf("\n]\n");
+    if (stats)
+        stats_print();
+    if (memory)
+        memory_print();
+
+    if (prelude)
+        lexer_free(prelude);
+    if (trace_path)
+        trace_write(trace_path);
     free_globals();
-    return 0;
+    return errors ? 1 : 0;
 }
@@ -0,0 +1,455 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+
+/* Incremental re-lexing, token stream of one file is kept together with
+ * checkpoints of the lexer state, so an edit only re-lexes from the last
+ * checkpoint before it until the state matches an old checkpoint again.
+ *
+ * A checkpoint is only taken at a line-start token of the file itself while
+ * no #include or macro expansion is active, the state there is fully given by
+ * where the line starts, open conditionals and macros. Macros are kept as a
+ * fork of the copy-on-write table, so a checkpoint only costs the pages the
+ * lexer writes afterwards. */
+
+typedef struct {
+    int token_idx;
+    int line_start;
+    int line;
+    cond_frame_t *conds;
+    int conds_len;
+    macro_table_t *macros;
+} relex_checkpoint_t;
+
+typedef struct {
+    lexer_t *lexer;
+    int file_idx;
+    /* Copies of every token except T_eof, with effective flags and loc */
+    token_t *tokens;
+    int len;
+    int capacity;
+    relex_checkpoint_t *checkpoints;
+    int checkpoints_len;
+    int checkpoints_capacity;
+    /* Tokens [changed_from, changed_to) were re-lexed by the last edit */
+    int changed_from;
+    int changed_to;
+} token_stream_t;
+
+void token_stream_push_token(token_stream_t *stream, lexer_t *lexer)
+{
+    token_t *token;
+
+    if (stream->len == stream->capacity) {
+        token_t *grown;
+
+        stream->capacity = stream->capacity * 2 + 256;
+        grown = malloc(stream->capacity * sizeof(token_t));
+        if (stream->len)
+            memcpy(grown, stream->tokens, stream->len * sizeof(token_t));
+        free(stream->tokens);
+        stream->tokens = grown;
+    }
+
+    token = &stream->tokens[stream->len++];
+    memcpy(token, lexer_cur_token(lexer), sizeof(token_t));
+    token->flags = lexer->cur_flags;
+    token->loc = lexer->cur_loc;
+    token->next = NULL;
+}
+
+void token_stream_push_checkpoint(token_stream_t *stream,
+                                  lexer_t *lexer,
+                                  int token_idx,
+                                  int line_start,
+                                  int line)
+{
+    regional_lexer_t *reg_lexer = lexer->global_lexer;
+    relex_checkpoint_t *checkpoint;
+
+    if (stream->checkpoints_len == stream->checkpoints_capacity) {
+        relex_checkpoint_t *grown;
+
+        stream->checkpoints_capacity = stream->checkpoints_capacity * 2 + 16;
+        grown = malloc(stream->checkpoints_capacity *
+                       sizeof(relex_checkpoint_t));
+        if (stream->checkpoints_len)
+            memcpy(grown, stream->checkpoints,
+                   stream->checkpoints_len * sizeof(relex_checkpoint_t));
+        free(stream->checkpoints);
+        stream->checkpoints = grown;
+    }
+
+    checkpoint = &stream->checkpoints[stream->checkpoints_len++];
+    checkpoint->token_idx = token_idx;
+    checkpoint->line_start = line_start;
+    checkpoint->line = line;
+    checkpoint->conds_len = reg_lexer->conds_len;
+    checkpoint->conds = malloc((reg_lexer->conds_len + 1) *
+                               sizeof(cond_frame_t));
+    memcpy(checkpoint->conds, reg_lexer->conds,
+           reg_lexer->conds_len * sizeof(cond_frame_t));
+    checkpoint->macros = macro_table_fork(lexer->macros);
+}
+
+void relex_checkpoint_free(relex_checkpoint_t *checkpoint)
+{
+    free(checkpoint->conds);
+    macro_table_free(checkpoint->macros);
+}
+
+/* Puts lexer back to the state at checkpoint */
+void relex_checkpoint_restore(lexer_t *lexer, relex_checkpoint_t *checkpoint)
+{
+    regional_lexer_t *reg_lexer = lexer->global_lexer;
+
+    while (lexer->regional_lexers->len)
+        lexer_stack_pop(lexer->regional_lexers);
+
+    reg_lexer->pos = checkpoint->line_start;
+    reg_lexer->line = checkpoint->line;
+    reg_lexer->col = 1;
+    reg_lexer->cur_token = NULL;
+    reg_lexer->inside_macro = false;
+    reg_lexer->conds_len = checkpoint->conds_len;
+    memcpy(reg_lexer->conds, checkpoint->conds,
+           checkpoint->conds_len * sizeof(cond_frame_t));
+
+    /* Cached conditions may refer to entries the older table lacks */
+    macro_table_free(lexer->macros);
+    lexer->macros = macro_table_fork(checkpoint->macros);
+    lexer_clear_cond_cache(lexer);
+    lexer->expansion_pending = false;
+}
+
+/* Whether lexer is in the same state as it was at checkpoint */
+bool relex_checkpoint_matches(lexer_t *lexer, relex_checkpoint_t *checkpoint)
+{
+    regional_lexer_t *reg_lexer = lexer->global_lexer;
+
+    if (reg_lexer->conds_len != checkpoint->conds_len)
+        return false;
+
+    for (int i = 0; i < checkpoint->conds_len; i++)
+        if (reg_lexer->conds[i].taken != checkpoint->conds[i].taken ||
+            reg_lexer->conds[i].seen_else != checkpoint->conds[i].seen_else)
+            return false;
+
+    return macro_table_equal(lexer->macros, checkpoint->macros);
+}
+
+/* Whether current token of lexer starts a line of the file itself outside of
+ * any #include or expansion, i.e. a checkpoint may be taken right before it */
+bool token_stream_at_line_start(lexer_t *lexer)
+{
+    return !lexer->regional_lexers->len &&
+           (lexer->cur_flags & TK_LINE_START) &&
+           !(lexer->cur_flags & TK_EXPANDED);
+}
+
+/* Lexes lexer to its end into a new token stream */
+token_stream_t *token_stream_init(lexer_t *lexer)
+{
+    token_stream_t *stream = calloc(1, sizeof(token_stream_t));
+    int last = 0;
+
+    stream->lexer = lexer;
+    stream->file_idx = lexer->global_lexer->file_idx;
+
+    /* Start of file is always a checkpoint */
+    token_stream_push_checkpoint(stream, lexer, 0, 0, 1);
+
+    while (lexer_next_token(lexer) != T_eof) {
+        if (token_stream_at_line_start(lexer) &&
+            stream->len - last >= RELEX_CHECKPOINT_INTERVAL) {
+            location_t *loc = &lexer->cur_loc;
+
+            last = stream->len;
+            token_stream_push_checkpoint(stream, lexer, stream->len,
+                                         loc->offset - (loc->col - 1),
+                                         loc->line);
+        }
+
+        token_stream_push_token(stream, lexer);
+    }
+
+    stream->changed_from = 0;
+    stream->changed_to = stream->len;
+    return stream;
+}
+
+int relex_count_newlines(char *str, int len)
+{
+    int count = 0;
+
+    for (int i = 0; i < len; i++)
+        if (is_newline(str[i]))
+            count++;
+
+    return count;
+}
+
+/* Replaces removed bytes at offset of source with inserted */
+void relex_apply_edit(char *source,
+                      int source_len,
+                      int offset,
+                      int removed,
+                      char *inserted,
+                      int inserted_len)
+{
+    int tail = source_len - offset - removed;
+
+    memmove(source + offset + inserted_len, source + offset + removed, tail);
+    memcpy(source + offset, inserted, inserted_len);
+    source[source_len - removed + inserted_len] = '\0';
+}
+
+/* Moves loc of the edited file that lies after the edit */
+void relex_shift_loc(token_stream_t *stream,
+                     location_t *loc,
+                     int edit_end,
+                     int delta,
+                     int line_delta)
+{
+    if (loc->file_idx != stream->file_idx || loc->offset < edit_end)
+        return;
+
+    loc->offset += delta;
+    loc->line += line_delta;
+}
+
+/* Replaces tokens and checkpoints from checkpoint restart up to checkpoint
+ * resync, or up to the end if resync is -1, with the ones of fresh, and
+ * shifts everything after by the edit */
+void token_stream_splice(token_stream_t *stream,
+                         token_stream_t *fresh,
+                         int restart,
+                         int resync,
+                         int edit_end,
+                         int delta,
+                         int line_delta)
+{
+    int start = stream->checkpoints[restart].token_idx, old_end = stream->len;
+    int cp_end = stream->checkpoints_len, tail, cp_tail, grow;
+
+    if (resync >= 0) {
+        old_end = stream->checkpoints[resync].token_idx;
+        cp_end = resync;
+    }
+
+    tail = stream->len - old_end;
+    grow = fresh->len - (old_end - start);
+
+    if (stream->len + grow > stream->capacity) {
+        token_t *grown;
+
+        stream->capacity = stream->len + grow + 256;
+        grown = malloc(stream->capacity * sizeof(token_t));
+        memcpy(grown, stream->tokens, start * sizeof(token_t));
+        memcpy(grown + start + fresh->len, stream->tokens + old_end,
+               tail * sizeof(token_t));
+        free(stream->tokens);
+        stream->tokens = grown;
+    } else {
+        memmove(stream->tokens + start + fresh->len, stream->tokens + old_end,
+                tail * sizeof(token_t));
+    }
+
+    if (fresh->len)
+        memcpy(stream->tokens + start, fresh->tokens,
+               fresh->len * sizeof(token_t));
+    stream->len += grow;
+
+    for (int i = start + fresh->len; i < stream->len; i++)
+        relex_shift_loc(stream, &stream->tokens[i].loc, edit_end, delta,
+                        line_delta);
+
+    for (int i = restart + 1; i < cp_end; i++)
+        relex_checkpoint_free(&stream->checkpoints[i]);
+
+    cp_tail = stream->checkpoints_len - cp_end;
+    if (restart + 1 + fresh->checkpoints_len + cp_tail >
+        stream->checkpoints_capacity) {
+        relex_checkpoint_t *grown;
+
+        stream->checkpoints_capacity =
+            restart + 1 + fresh->checkpoints_len + cp_tail + 16;
+        grown =
+            malloc(stream->checkpoints_capacity * sizeof(relex_checkpoint_t));
+        memcpy(grown, stream->checkpoints,
+               stream->checkpoints_len * sizeof(relex_checkpoint_t));
+        free(stream->checkpoints);
+        stream->checkpoints = grown;
+    }
+
+    memmove(stream->checkpoints + restart + 1 + fresh->checkpoints_len,
+            stream->checkpoints + cp_end, cp_tail * sizeof(relex_checkpoint_t));
+    if (fresh->checkpoints_len)
+        memcpy(stream->checkpoints + restart + 1, fresh->checkpoints,
+               fresh->checkpoints_len * sizeof(relex_checkpoint_t));
+    stream->checkpoints_len = restart + 1 + fresh->checkpoints_len + cp_tail;
+
+    for (int i = restart + 1 + fresh->checkpoints_len;
+         i < stream->checkpoints_len; i++) {
+        relex_checkpoint_t *checkpoint = &stream->checkpoints[i];
+
+        checkpoint->token_idx += grow;
+        checkpoint->line_start += delta;
+        checkpoint->line += line_delta;
+        for (int j = 0; j < checkpoint->conds_len; j++)
+            relex_shift_loc(stream, &checkpoint->conds[j].loc, edit_end, delta,
+                            line_delta);
+    }
+
+    stream->changed_from = start;
+    stream->changed_to = start + fresh->len;
+}
+
+/* Applies edit to the file of stream, removed bytes at offset are replaced
+ * with inserted, and re-lexes as little as needed. Afterwards stream is the
+ * same as if the edited file had been lexed from scratch; tokens that were
+ * re-lexed are [changed_from, changed_to), later ones are shifted. Returns
+ * the number of tokens re-lexed. */
+int token_stream_edit(token_stream_t *stream,
+                      int offset,
+                      int removed,
+                      char *inserted)
+{
+    lexer_t *lexer = stream->lexer;
+    regional_lexer_t *reg_lexer = lexer->global_lexer;
+    int inserted_len = strlen(inserted), delta, line_delta, restart = 0;
+    int resync = -1, candidate, last;
+    token_stream_t fresh;
+
+    if (offset < 0 || removed < 0 || offset + removed > reg_lexer->source_len)
+        error("Edit is out of range", NULL);
+    if (reg_lexer->source_len - removed + inserted_len >= MAX_SOURCE)
+        error("Source is too large after edit", NULL);
+
+    delta = inserted_len - removed;
+    line_delta = relex_count_newlines(inserted, inserted_len) -
+                 relex_count_newlines(reg_lexer->source + offset, removed);
+
+    /* The lexer scans the file map buffer itself */
+    relex_apply_edit(reg_lexer->source, reg_lexer->source_len, offset, removed,
+                     inserted, inserted_len);
+    reg_lexer->source_len += delta;
+
+    /* Text before offset is unchanged, so is the state at its last line */
+    while (restart + 1 < stream->checkpoints_len &&
+           stream->checkpoints[restart + 1].line_start <= offset)
+        restart++;
+
+    relex_checkpoint_restore(lexer, &stream->checkpoints[restart]);
+
+    memset(&fresh, 0, sizeof(token_stream_t));
+    last = stream->checkpoints[restart].token_idx;
+    candidate = restart + 1;
+
+    while (lexer_next_token(lexer) != T_eof) {
+        int token_idx = stream->checkpoints[restart].token_idx + fresh.len;
+        location_t *loc = &lexer->cur_loc;
+        int line_start = loc->offset - (loc->col - 1);
+
+        if (!token_stream_at_line_start(lexer)) {
+            token_stream_push_token(&fresh, lexer);
+            continue;
+        }
+
+        /* Old stream takes over again once past the edit and in the same
+         * state at an old checkpoint */
+        if (line_start >= offset + inserted_len) {
+            while (candidate < stream->checkpoints_len &&
+                   stream->checkpoints[candidate].line_start + delta <
+                       line_start)
+                candidate++;
+
+            if (candidate < stream->checkpoints_len &&
+                stream->checkpoints[candidate].line_start + delta ==
+                    line_start &&
+                relex_checkpoint_matches(lexer,
+                                         &stream->checkpoints[candidate])) {
+                resync = candidate;
+                break;
+            }
+        }
+
+        if (token_idx - last >= RELEX_CHECKPOINT_INTERVAL) {
+            last = token_idx;
+            token_stream_push_checkpoint(&fresh, lexer, token_idx, line_start,
+                                         loc->line);
+        }
+
+        token_stream_push_token(&fresh, lexer);
+    }
+
+    token_stream_splice(stream, &fresh, restart, resync, offset + removed,
+                        delta, line_delta);
+
+    free(fresh.tokens);
+    free(fresh.checkpoints);
+    return fresh.len;
+}
+
+/* Whether tokens a and b are the same, spacing and location included */
+bool relex_tokens_equal(token_t *a, token_t *b)
+{
+    if (a->typ != b->typ || a->flags != b->flags ||
+        a->loc.file_idx != b->loc.file_idx || a->loc.line != b->loc.line ||
+        a->loc.col != b->loc.col || a->loc.offset != b->loc.offset)
+        return false;
+
+    if (a->typ == T_string)
+        return a->str_len == b->str_len &&
+               !memcmp(token_string(a), token_string(b), a->str_len);
+
+    return !strcmp(token_literal(a), token_literal(b));
+}
+
+/* Lexes the file of stream from scratch, starting from the macros it started
+ * with, and compares the result with stream. Returns index of the first token
+ * that differs, -1 if there is none. */
+int token_stream_verify(token_stream_t *stream)
+{
+    lexer_t *lexer = lexer_create(NULL, macro_table_fork(
+                                            stream->checkpoints[0].macros));
+    int i = 0;
+
+    lexer->global_lexer = reg_lexer_source_init(
+        lexer->arena, FILE_SOURCES[stream->file_idx],
+        stream->lexer->global_lexer->source_len, stream->file_idx);
+
+    while (lexer_next_token(lexer) != T_eof) {
+        token_t token;
+
+        if (i == stream->len)
+            break;
+
+        memcpy(&token, lexer_cur_token(lexer), sizeof(token_t));
+        token.flags = lexer->cur_flags;
+        token.loc = lexer->cur_loc;
+        if (!relex_tokens_equal(&token, &stream->tokens[i]))
+            break;
+        i++;
+    }
+
+    if (i == stream->len && lexer_cur_token_type(lexer) == T_eof)
+        i = -1;
+
+    lexer_free(lexer);
+    return i;
+}
+
+/* Frees stream and its checkpoints, the lexer is left to the caller */
+void token_stream_free(token_stream_t *stream)
+{
+    for (int i = 0; i < stream->checkpoints_len; i++)
+        relex_checkpoint_free(&stream->checkpoints[i]);
+
+    free(stream->checkpoints);
+    free(stream->tokens);
+    free(stream);
+}
@@ -0,0 +1,473 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+
+/* Prelude snapshot, lexer state after a common prelude of #defines, stored so
+ * that later runs skip lexing the prelude altogether.
+ *
+ * Layout, every int is 32-bit little-endian and every reference is an index
+ * or an offset, so the image does not depend on where it is loaded:
+ *
+ *   header:  magic, version, files_len, records_len, tokens_len, strings_size
+ *   files:   path_off, size, content_hash      (validity of the snapshot)
+ *   macros:  tokens_idx, replacement_len, flags, generation (unused, since
+ *            restored macros get generations of the running process)
+ *   tokens:  typ, hash, flags, file_idx, line, col, offset, literal_off
+ *   strings: NUL-terminated spellings, each distinct one stored once
+ *
+ * Spelling of a T_string is its whole decoded contents, with backslashes and
+ * NUL bytes escaped (see snapshot_intern_token). Every macro owns 1 + replacement_len consecutive tokens, the first one is
+ * its name. */
+
+#define SNAPSHOT_MAGIC 0x53504853 /* "SHPS" */
+#define SNAPSHOT_VERSION 4
+#define SNAPSHOT_STRINGS_BUCKETS 4096
+#define SNAPSHOT_TOKEN_INTS 8
+
+#define SNAPSHOT_MACRO_DEFINED 1
+#define SNAPSHOT_MACRO_FUNCTION_LIKE 2
+
+/* Set once a read ran past the end of the file, see snapshot_read_byte */
+bool snapshot_truncated = false;
+
+typedef struct {
+    char *data;
+    int size;
+    int capacity;
+    /* Open addressing table over offsets into data, stores offset + 1, only
+     * filled up to half so probing always terminates */
+    int buckets[SNAPSHOT_STRINGS_BUCKETS];
+    int buckets_used;
+} snapshot_strings_t;
+
+snapshot_strings_t *snapshot_strings_init()
+{
+    snapshot_strings_t *strings =
+        mem_calloc(MEM_interning, sizeof(snapshot_strings_t));
+
+    strings->capacity = 4096;
+    strings->data = mem_alloc(MEM_interning, strings->capacity);
+    return strings;
+}
+
+void snapshot_strings_free(snapshot_strings_t *strings)
+{
+    mem_free(MEM_interning, strings->data, strings->capacity);
+    mem_free(MEM_interning, strings, sizeof(snapshot_strings_t));
+}
+
+int snapshot_content_hash(char *source, int len)
+{
+    int hash = HASH_SEED;
+
+    for (int i = 0; i < len; i++)
+        hash = ((hash << 5) + hash + source[i]) & HASH_MASK;
+
+    return hash;
+}
+
+/* Interns the len bytes at str, none of them NUL, into the string pool,
+ * returns its offset */
+int snapshot_intern_len(snapshot_strings_t *strings, char *str, int len)
+{
+    int hash = snapshot_content_hash(str, len);
+    int slot = hash & (SNAPSHOT_STRINGS_BUCKETS - 1), offset;
+
+    while (strings->buckets[slot]) {
+        offset = strings->buckets[slot] - 1;
+        if (!strncmp(strings->data + offset, str, len) &&
+            !strings->data[offset + len])
+            return offset;
+        slot = (slot + 1) & (SNAPSHOT_STRINGS_BUCKETS - 1);
+    }
+
+    if (strings->size + len + 1 > strings->capacity) {
+        char *data;
+        int capacity = strings->capacity;
+
+        while (strings->size + len + 1 > capacity)
+            capacity *= 2;
+
+        data = mem_alloc(MEM_interning, capacity);
+        memcpy(data, strings->data, strings->size);
+        mem_free(MEM_interning, strings->data, strings->capacity);
+        strings->data = data;
+        strings->capacity = capacity;
+    }
+
+    offset = strings->size;
+    memcpy(strings->data + offset, str, len);
+    strings->data[offset + len] = '\0';
+    strings->size += len + 1;
+
+    if (strings->buckets_used * 2 < SNAPSHOT_STRINGS_BUCKETS) {
+        strings->buckets[slot] = offset + 1;
+        strings->buckets_used++;
+    }
+
+    return offset;
+}
+
+int snapshot_intern(snapshot_strings_t *strings, char *str)
+{
+    return snapshot_intern_len(strings, str, strlen(str));
+}
+
+/* Interns spelling of token. A T_string is interned with all of its
+ * contents rather than the prefix in literal, backslashes and NUL bytes are
+ * escaped by a backslash and the latter spelled as 0. */
+int snapshot_intern_token(snapshot_strings_t *strings, token_t *token)
+{
+    char *str, *escaped;
+    int len = 0, offset;
+
+    if (token->typ != T_string)
+        return snapshot_intern(strings, token_literal(token));
+
+    str = token_string(token);
+    escaped = malloc(token->str_len * 2 + 1);
+    for (int i = 0; i < token->str_len; i++) {
+        if (str[i] == '\\' || !str[i])
+            escaped[len++] = '\\';
+        escaped[len++] = str[i] ? str[i] : '0';
+    }
+
+    offset = snapshot_intern_len(strings, escaped, len);
+    free(escaped);
+    return offset;
+}
+
+/* Restores literal and the values derived from it of token from its interned
+ * spelling, token->typ must be set */
+void snapshot_read_spelling(token_t *token, char *spelling)
+{
+    int len = strlen(spelling);
+
+    token->str = NULL;
+    token->str_len = 0;
+    token->value = 0;
+    token->num_flags = 0;
+    token->len = 0;
+
+    if (token->typ == T_string) {
+        token->str = string_alloc(len);
+        for (int i = 0; i < len; i++) {
+            char ch = spelling[i];
+
+            if (ch == '\\' && i + 1 < len) {
+                ch = spelling[++i];
+                if (ch == '0')
+                    ch = '\0';
+            }
+            token->str[token->str_len++] = ch;
+        }
+        spelling = token->str;
+        len = token->str_len;
+    } else if (token->typ == T_numeric) {
+        scan_numeric(spelling, &token->value, &token->num_flags);
+    } else if (token->typ == T_char) {
+        token->value = spelling[0];
+    }
+
+    token->symbol = token->typ == T_identifier
+                        ? symbol_intern(spelling, len, hash_identifier(spelling))
+                        : -1;
+
+    if (len > MAX_TOKEN_LEN - 1)
+        len = MAX_TOKEN_LEN - 1;
+    memcpy(token->literal, spelling, len);
+    token->literal[len] = '\0';
+}
+
+void snapshot_write_int(FILE *f, int value)
+{
+    fputc(value & 255, f);
+    fputc((value >> 8) & 255, f);
+    fputc((value >> 16) & 255, f);
+    fputc((value >> 24) & 255, f);
+}
+
+/* Reads a byte, a short read sets snapshot_truncated */
+char snapshot_read_byte(FILE *f)
+{
+    int ch = fgetc(f);
+
+    if (ch < 0)
+        snapshot_truncated = true;
+    return ch;
+}
+
+int snapshot_read_int(FILE *f)
+{
+    int value = 0;
+
+    for (int i = 0; i < 4; i++)
+        value |= (snapshot_read_byte(f) & 255) << (i * 8);
+
+    return value;
+}
+
+void snapshot_write_token(FILE *f, snapshot_strings_t *strings, token_t *token)
+{
+    snapshot_write_int(f, token->typ);
+    snapshot_write_int(f, token->hash);
+    snapshot_write_int(f, token->flags);
+    snapshot_write_int(f, token->loc.file_idx);
+    snapshot_write_int(f, token->loc.line);
+    snapshot_write_int(f, token->loc.col);
+    snapshot_write_int(f, token->loc.offset);
+    snapshot_write_int(f, snapshot_intern_token(strings, token));
+}
+
+/* Serializes file map and macros, only valid right after the prelude has
+ * been lexed to its end. */
+void snapshot_save(char *snapshot_path, macro_table_t *macros)
+{
+    snapshot_strings_t *strings = snapshot_strings_init();
+    int tokens_len = 0, *paths = malloc(file_map_idx * sizeof(int));
+    FILE *f = fopen(snapshot_path, "wb");
+
+    if (!f) {
+        printf("[%s] Error: Failed to write snapshot\n", snapshot_path);
+        exit(1);
+    }
+
+    /* Strings are interned up front, so the pool size is known for header */
+    for (int i = 0; i < file_map_idx; i++)
+        paths[i] = snapshot_intern(strings, FILE_NAMES[i]);
+
+    for (int i = 0; i < macros->len; i++) {
+        macro_t *macro = macro_table_get(macros, i);
+
+        tokens_len += 1 + macro->replacement_len;
+        snapshot_intern_token(strings, macro->name);
+        for (int j = 0; j < macro->replacement_len; j++)
+            snapshot_intern_token(strings, &macro->replacement[j]);
+    }
+
+    snapshot_write_int(f, SNAPSHOT_MAGIC);
+    snapshot_write_int(f, SNAPSHOT_VERSION);
+    snapshot_write_int(f, file_map_idx);
+    snapshot_write_int(f, macros->len);
+    snapshot_write_int(f, tokens_len);
+    snapshot_write_int(f, strings->size);
+
+    for (int i = 0; i < file_map_idx; i++) {
+        int len = strlen(FILE_SOURCES[i]);
+
+        snapshot_write_int(f, paths[i]);
+        snapshot_write_int(f, len);
+        snapshot_write_int(f, snapshot_content_hash(FILE_SOURCES[i], len));
+    }
+
+    tokens_len = 0;
+    for (int i = 0; i < macros->len; i++) {
+        macro_t *macro = macro_table_get(macros, i);
+        int flags = 0;
+
+        if (macro->defined)
+            flags |= SNAPSHOT_MACRO_DEFINED;
+        if (macro->functiono_like)
+            flags |= SNAPSHOT_MACRO_FUNCTION_LIKE;
+
+        snapshot_write_int(f, tokens_len);
+        snapshot_write_int(f, macro->replacement_len);
+        snapshot_write_int(f, flags);
+        snapshot_write_int(f, macro->generation);
+        tokens_len += 1 + macro->replacement_len;
+    }
+
+    for (int i = 0; i < macros->len; i++) {
+        macro_t *macro = macro_table_get(macros, i);
+
+        snapshot_write_token(f, strings, macro->name);
+        for (int j = 0; j < macro->replacement_len; j++)
+            snapshot_write_token(f, strings, &macro->replacement[j]);
+    }
+
+    for (int i = 0; i < strings->size; i++)
+        fputc(strings->data[i], f);
+
+    fclose(f);
+    free(paths);
+    snapshot_strings_free(strings);
+}
+
+/* Rebuilds token from its SNAPSHOT_TOKEN_INTS ints record */
+void snapshot_read_token(int *record, char *strings, token_t *token)
+{
+    token->typ = record[0];
+    token->hash = record[1];
+    token->flags = record[2];
+    token->loc.file_idx = record[3];
+    token->loc.line = record[4];
+    token->loc.col = record[5];
+    token->loc.offset = record[6];
+    snapshot_read_spelling(token, strings + record[7]);
+    token->next = NULL;
+}
+
+/* Reads every file of a files table, path_off, size and content_hash per
+ * file, and appends them to file map. Returns file map index of the first
+ * one, or -1 without touching file map if any of them changed since. */
+int snapshot_map_files(int *files, int files_len, char *strings)
+{
+    char **sources = calloc(files_len, sizeof(char *));
+    bool valid = file_map_idx + files_len <= MAX_FILES;
+    int base = file_map_idx;
+
+    for (int i = 0; valid && i < files_len; i++) {
+        int len;
+
+        sources[i] = file_read(strings + files[i * 3], &len);
+        valid = sources[i] && len == files[i * 3 + 1] &&
+                snapshot_content_hash(sources[i], len) == files[i * 3 + 2];
+    }
+
+    for (int i = 0; i < files_len; i++) {
+        if (valid)
+            file_map_append(strings + files[i * 3], sources[i], true);
+        else
+            file_source_free(sources[i]);
+    }
+
+    free(sources);
+    return valid ? base : -1;
+}
+
+/* Restores file map and the empty macros table from snapshot. Fails without
+ * touching any state if the snapshot is missing, malformed, was not taken for
+ * prelude_path, or any file it was taken from changed since. Must be called
+ * before anything else is lexed. */
+bool snapshot_load(char *snapshot_path,
+                   char *prelude_path,
+                   macro_table_t *macros)
+{
+    int files_len, records_len, tokens_len, strings_size;
+    int *files = NULL, *records = NULL, *tokens = NULL;
+    char *strings = NULL;
+    bool valid;
+    token_t *token;
+    FILE *f;
+
+    if (file_map_idx || macros->len)
+        return false;
+
+    f = fopen(snapshot_path, "rb");
+    if (!f)
+        return false;
+
+    snapshot_truncated = false;
+    valid = snapshot_read_int(f) == SNAPSHOT_MAGIC &&
+            snapshot_read_int(f) == SNAPSHOT_VERSION;
+
+    files_len = snapshot_read_int(f);
+    records_len = snapshot_read_int(f);
+    tokens_len = snapshot_read_int(f);
+    strings_size = snapshot_read_int(f);
+
+    valid = valid && !snapshot_truncated && files_len > 0 &&
+            files_len <= MAX_FILES && records_len >= 0 &&
+            tokens_len >= records_len && strings_size > 0;
+
+    if (valid) {
+        files = malloc(files_len * 3 * sizeof(int));
+        for (int i = 0; i < files_len * 3; i++)
+            files[i] = snapshot_read_int(f);
+
+        records = malloc(records_len * 4 * sizeof(int));
+        for (int i = 0; i < records_len * 4; i++)
+            records[i] = snapshot_read_int(f);
+
+        tokens = malloc(tokens_len * SNAPSHOT_TOKEN_INTS * sizeof(int));
+        for (int i = 0; i < tokens_len * SNAPSHOT_TOKEN_INTS; i++)
+            tokens[i] = snapshot_read_int(f);
+
+        strings = malloc(strings_size);
+        for (int i = 0; i < strings_size; i++)
+            strings[i] = snapshot_read_byte(f);
+        strings[strings_size - 1] = '\0';
+
+        valid = !snapshot_truncated;
+        for (int i = 0; valid && i < files_len; i++)
+            valid = files[i * 3] >= 0 && files[i * 3] < strings_size;
+        for (int i = 0; valid && i < tokens_len; i++) {
+            int typ = tokens[i * SNAPSHOT_TOKEN_INTS];
+            int literal = tokens[i * SNAPSHOT_TOKEN_INTS + 7];
+
+            valid = typ >= 0 && typ <= T_backslash && literal >= 0 &&
+                    literal < strings_size &&
+                    (typ == T_string ||
+                     strlen(strings + literal) < MAX_TOKEN_LEN);
+        }
+        for (int i = 0; valid && i < records_len; i++)
+            valid = records[i * 4] >= 0 && records[i * 4 + 1] >= 0 &&
+                    records[i * 4] + 1 + records[i * 4 + 1] <= tokens_len;
+    }
+
+    fclose(f);
+
+    /* Validates every file the snapshot was taken from */
+    valid = valid && !strcmp(strings + files[0], prelude_path) &&
+            snapshot_map_files(files, files_len, strings) >= 0;
+
+    if (valid) {
+        token = malloc(sizeof(token_t));
+
+        for (int i = 0; i < records_len; i++) {
+            int *record = &tokens[records[i * 4] * SNAPSHOT_TOKEN_INTS];
+            int len = records[i * 4 + 1], flags = records[i * 4 + 2];
+            macro_t *macro;
+
+            snapshot_read_token(record, strings, token);
+            macro = define_macro(macros, token,
+                                 flags & SNAPSHOT_MACRO_FUNCTION_LIKE);
+
+            for (int j = 1; j <= len; j++) {
+                snapshot_read_token(record + j * SNAPSHOT_TOKEN_INTS, strings,
+                                    token);
+                macro->name = macro_tokens_append(macro->name, j, token);
+            }
+
+            macro->replacement = macro->name + 1;
+            macro->replacement_len = len;
+            macro->defined = flags & SNAPSHOT_MACRO_DEFINED;
+        }
+
+        free(token);
+    }
+
+    free(strings);
+    free(tokens);
+    free(records);
+    free(files);
+    return valid;
+}
+
+/* Lexes prelude_path to its end and returns the resulting context, whose
+ * macros are meant to be shared by lexer_fork. With a snapshot_path, state is
+ * restored from that snapshot if it is still valid, otherwise the snapshot is
+ * rewritten. */
+lexer_t *lexer_load_prelude(char *prelude_path, char *snapshot_path)
+{
+    lexer_t *lexer;
+
+    if (snapshot_path) {
+        lexer = lexer_init(NULL);
+        if (snapshot_load(snapshot_path, prelude_path, lexer->macros))
+            return lexer;
+        lexer_free(lexer);
+    }
+
+    lexer = lexer_init(prelude_path);
+    while (lexer_next_token(lexer) != T_eof)
+        ;
+
+    if (snapshot_path)
+        snapshot_save(snapshot_path, lexer->macros);
+
+    return lexer;
+}
@@ -0,0 +1,110 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+
+/* --stats report of the hot path counters in STATS */
+
+#define STATS_NAME_GROUPS 11
+
+/* Prints spelling of token type typ without its T_ prefix, padded to a
+ * column, groups hold every name of token_type_t in declaration order */
+void stats_print_token_name(int typ)
+{
+    char *groups[STATS_NAME_GROUPS];
+    int len = 0;
+
+    printf("  ");
+
+    groups[0] = "numeric identifier comma string char open_bracket ";
+    groups[1] = "close_bracket open_curly close_curly open_square ";
+    groups[2] = "close_square asterisk divide mod bit_or bit_xor bit_not ";
+    groups[3] = "log_and log_or log_not lt gt le ge lshift rshift dot ";
+    groups[4] = "arrow plus minus minuseq pluseq oreq andeq eq noteq ";
+    groups[5] = "assign increment decrement question colon semicolon eof ";
+    groups[6] = "ampersand return if else while for do typedef enum struct ";
+    groups[7] = "sizeof elipsis switch case break default continue ";
+    groups[8] = "cppd_hash cppd_hashhash cppd_include cppd_define ";
+    groups[9] = "cppd_undef cppd_error cppd_if cppd_elif cppd_else ";
+    groups[10] = "cppd_endif cppd_ifdef cppd_ifndef newline backslash ";
+
+    for (int i = 0; i < STATS_NAME_GROUPS; i++) {
+        for (char *p = groups[i]; *p; p++) {
+            if (*p == ' ') {
+                typ--;
+                continue;
+            }
+            if (!typ) {
+                printf("%c", *p);
+                len++;
+            }
+        }
+    }
+
+    while (len++ < 17)
+        printf(" ");
+}
+
+void stats_print()
+{
+#ifdef SHEPHERD_STATS
+    int total = 0;
+
+    printf("tokens by type:\n");
+    for (int i = 0; i <= T_backslash; i++) {
+        if (!STATS.tokens[i])
+            continue;
+        stats_print_token_name(i);
+        printf("%d\n", STATS.tokens[i]);
+        total += STATS.tokens[i];
+    }
+    printf("  total            %d\n", total);
+
+    printf("skipped bytes:\n");
+    printf("  white space      %d\n", STATS.white_space_bytes);
+    printf("  comments         %d\n", STATS.comment_bytes);
+    printf("  dead groups      %d\n", STATS.dead_bytes);
+
+    printf("macros:\n");
+    printf("  find_macro calls %d\n", STATS.find_macro_calls);
+    printf("  find_macro hits  %d\n", STATS.find_macro_hits);
+    printf("  expansions       %d\n", STATS.expansions);
+    printf("  max stack depth  %d\n", STATS.max_stack_depth);
+    printf("  symbols          %d\n", symbol_count());
+
+    printf("includes:\n");
+    printf("  lookups          %d\n", STATS.include_lookups);
+    printf("  cache hits       %d\n", STATS.include_cache_hits);
+    printf("  file probes      %d\n", STATS.file_probes);
+    printf("  prefetched       %d\n", STATS.include_prefetches);
+
+    printf("memory:\n");
+    printf("  token arenas     %d, %d tokens of %d bytes\n",
+           STATS.arena_chunks, STATS.arena_tokens, sizeof(token_t));
+    printf("  macro chunks     %d, %d tokens of %d bytes\n",
+           STATS.macro_chunks, STATS.macro_tokens, sizeof(token_t));
+    printf("  regional lexers  %d of %d bytes\n", STATS.reg_lexers,
+           sizeof(regional_lexer_t));
+#else
+    printf("Statistics are not compiled in, rebuild with `make STATS=1`\n");
+#endif
+}
+
+/* --memory report of lexer_memory_stats */
+void memory_print()
+{
+    memory_stats_t *memory = lexer_memory_stats();
+
+    printf("memory (bytes):   current    peak\n");
+    for (int i = 0; i < MEM_OWNERS; i++) {
+        char *name = memory_owner_name(i);
+        int len = strlen(name);
+
+        printf("  %s", name);
+        while (len++ < 16)
+            printf(" ");
+        printf("%d %d\n", memory->owners[i].current, memory->owners[i].peak);
+    }
+}
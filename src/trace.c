@@ -0,0 +1,187 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+
+/* Optional tracer, begin and end events of file lexing, directives and macro
+ * expansions go to a ring buffer allocated up front and are written as Chrome
+ * trace event JSON by trace_write. Every kind of span has its own track, so
+ * spans of a track always nest.
+ *
+ * shecc's libc has no clock, timestamps count tokens lexed so far unless the
+ * build provides SHEPHERD_MONOTONIC_CLOCK (see bench/host.h), in which case
+ * they are microseconds. */
+
+#define TRACE_FILE 1
+#define TRACE_DIRECTIVE 2
+#define TRACE_MACRO 3
+
+typedef struct {
+    int ts;
+    int track;
+    bool begin;
+    char name[TRACE_NAME_LEN];
+} trace_event_t;
+
+typedef struct {
+    trace_event_t events[TRACE_EVENTS];
+    /* Index of the oldest event and number of events held */
+    int head;
+    int len;
+    int dropped;
+} trace_t;
+
+/* NULL unless tracing is enabled */
+trace_t *TRACE = NULL;
+
+/* Tokens lexed so far, clock of builds without a monotonic clock */
+int TRACE_TICKS = 0;
+
+void trace_init()
+{
+    TRACE = malloc(sizeof(trace_t));
+    TRACE->head = 0;
+    TRACE->len = 0;
+    TRACE->dropped = 0;
+}
+
+int trace_clock()
+{
+#ifdef SHEPHERD_MONOTONIC_CLOCK
+    return shepherd_monotonic_us();
+#else
+    return TRACE_TICKS;
+#endif
+}
+
+/* Records an event, overwriting the oldest one when the ring is full. Name
+ * is only used by begin events and may be transient. */
+void trace_event(int track, bool begin, char *prefix, char *name)
+{
+    trace_event_t *event;
+    int len = 0;
+
+    if (TRACE->len == TRACE_EVENTS) {
+        TRACE->head = (TRACE->head + 1) % TRACE_EVENTS;
+        TRACE->len--;
+        TRACE->dropped++;
+    }
+
+    event = &TRACE->events[(TRACE->head + TRACE->len++) % TRACE_EVENTS];
+    event->ts = trace_clock();
+    event->track = track;
+    event->begin = begin;
+
+    for (char *p = prefix; *p && len < TRACE_NAME_LEN - 1; p++)
+        event->name[len++] = *p;
+    for (char *p = name; *p && len < TRACE_NAME_LEN - 1; p++)
+        event->name[len++] = *p;
+    event->name[len] = '\0';
+}
+
+void trace_begin(int track, char *prefix, char *name)
+{
+    if (TRACE)
+        trace_event(track, true, prefix, name);
+}
+
+void trace_end(int track)
+{
+    if (TRACE)
+        trace_event(track, false, "", "");
+}
+
+void trace_put_str(FILE *f, char *str)
+{
+    for (; *str; str++)
+        fputc(*str, f);
+}
+
+void trace_put_int(FILE *f, int value)
+{
+    char digits[12];
+    int len = 0;
+
+    if (value < 0) {
+        fputc('-', f);
+        value = -value;
+    }
+
+    do {
+        digits[len++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+
+    while (len)
+        fputc(digits[--len], f);
+}
+
+/* Writes every event held as Chrome trace event JSON. An end event whose
+ * begin event was overwritten is left out with it, as spans of a track nest
+ * it is one that closes more spans than the track has open. */
+void trace_write(char *trace_path)
+{
+    FILE *f = fopen(trace_path, "wb");
+    int depth[TRACE_MACRO + 1], written = 0, dropped = TRACE->dropped;
+
+    if (!f) {
+        printf("[%s] Error: Failed to write trace\n", trace_path);
+        exit(1);
+    }
+
+    trace_put_str(f, "{\"traceEvents\": [\n");
+
+    for (int i = 0; i <= TRACE_MACRO; i++)
+        depth[i] = 0;
+
+    for (int i = 0; i < TRACE->len; i++) {
+        trace_event_t *event =
+            &TRACE->events[(TRACE->head + i) % TRACE_EVENTS];
+
+        if (event->begin) {
+            depth[event->track]++;
+        } else if (depth[event->track]) {
+            depth[event->track]--;
+        } else {
+            dropped++;
+            continue;
+        }
+
+        trace_put_str(f, written++ ? ",\n" : "");
+        trace_put_str(f, "{\"ph\": \"");
+        trace_put_str(f, event->begin ? "B" : "E");
+        trace_put_str(f, "\", \"pid\": 1, \"tid\": ");
+        trace_put_int(f, event->track);
+        trace_put_str(f, ", \"ts\": ");
+        trace_put_int(f, event->ts);
+
+        if (event->begin) {
+            trace_put_str(f, ", \"cat\": \"");
+            trace_put_str(f, event->track == TRACE_FILE        ? "file"
+                             : event->track == TRACE_DIRECTIVE ? "directive"
+                                                               : "macro");
+            trace_put_str(f, "\", \"name\": \"");
+            for (char *p = event->name; *p; p++) {
+                if (*p == '"' || *p == '\\')
+                    fputc('\\', f);
+                fputc(*p, f);
+            }
+            trace_put_str(f, "\"");
+        }
+
+        trace_put_str(f, "}");
+    }
+
+    trace_put_str(f, "\n], \"otherData\": {\"dropped\": ");
+    trace_put_int(f, dropped);
+    trace_put_str(f, ", \"clock\": \"");
+#ifdef SHEPHERD_MONOTONIC_CLOCK
+    trace_put_str(f, "us");
+#else
+    trace_put_str(f, "tokens");
+#endif
+    trace_put_str(f, "\"}}\n");
+    fclose(f);
+}
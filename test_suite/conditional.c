@@ -0,0 +1,41 @@
+#define FOO 1
+#define FOO_VERSION 4
+
+#if defined(FOO) && FOO_VERSION >= 3
+ok1;
+#else
+bad1;
+#endif
+#if defined BAR || (FOO_VERSION - 4) ? 1 : 0
+bad2;
+#elif FOO_VERSION * 2 == 8 && !defined(BAR)
+ok2;
+#elif 1 / 0
+bad3;
+#else
+bad4;
+#endif
+#ifdef BAR
+# if 1
+bad5 don't care ' "
+# endif
+#elif 0 || 0 && 1/0
+bad6;
+#else
+ok3;
+#endif
+#ifndef BAR
+ok4;
+#endif
+#if 0
+/* #endif
+*/
+bad7;
+#endif
+#if (1 << 4) % 5 == 1 && -1 < 0 && ~0 == -1 && (3 ^ 1) == 2 && (6 & 3 | 8) == 10 \
+    && 8/2 == 4
+ok5;
+#endif
+#if defined(FOO) && FOO_VERSION >= 3
+ok6;
+#endif
@@ -0,0 +1,21 @@
+/* Lexed by `make check` with --max-errors 0, every error is reported and
+ * lexing goes on to the end of the file */
+#define
+#include nothing
+int a = 1 @ 2 ` ` `;
+char *s = "unterminated;
+char c = '\q';
+#if 1 +
+int in_failed_if;
+#elif defined(X
+#else
+int else_taken;
+#endif
+#endif
+#bogus
+x # y
+#ifdef
+int z;
+#endif
+#if 1
+int last_token;
@@ -0,0 +1,10 @@
+/* #include "not_a_dependency.h" inside a comment is ignored */
+#include "include.h" // comments may follow the header name
+/* or come first */ #include "include.h"
+#if 0
+#include "missing.h"
+/* a comment before the # of a skipped directive */ #else
+#define FOUND found
+#endif
+
+GREETING FOUND;
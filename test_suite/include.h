@@ -0,0 +1,5 @@
+/* Included by include.c, guarded so a second #include is empty */
+#ifndef INCLUDE_H
+#define INCLUDE_H
+#define GREETING hello
+#endif
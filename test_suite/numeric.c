@@ -0,0 +1,7 @@
+/* Every literal below is a single token */
+int values = 0x1F + 017 + 0b101 + 10UL + 42ull + 123456789;
+double floats = 1.5e3 + .5f + 1e+5 + 0x1.8p3 + 3.;
+
+#if 0x10 == 16 && 017 == 15 && 0b11 == 3 && 10UL == 10 && 1000000 / 7 == 142857
+int ok;
+#endif
@@ -0,0 +1,39 @@
+/* Edited by `make check`, every edit must give the same tokens as lexing the
+ * edited file from scratch */
+#if A == 1
+x0;
+#endif
+#define A 1
+#if A == 1
+yes;
+#else
+no;
+#endif
+
+#define B 0
+int f0 = 0;
+int f1 = 1;
+int f2 = 2;
+int f3 = 3;
+int f4 = 4;
+int f5 = 5;
+int f6 = 6;
+int f7 = 7;
+int f8 = 8;
+int f9 = 9;
+int f10 = 10;
+int f11 = 11;
+int f12 = 12;
+int f13 = 13;
+int f14 = 14;
+int f15 = 15;
+int f16 = 16;
+int f17 = 17;
+int f18 = 18;
+int f19 = 19;
+#define B 1
+#if B == 1
+yes;
+#else
+no;
+#endif
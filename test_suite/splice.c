@@ -0,0 +1,29 @@
+/* Line splices join physical lines before tokens are formed */
+#define SUM first + \
+    second + \
+    third
+int total = SUM;
+int spl\
+it = 1;
+char *str = "spliced \
+string";
+int value = 1\
+2;
+total +\
+= value;
+// comment carried over \
+int hidden;
+
+#if 1 + \
+    1 == 2
+int ok;
+#endif
+#define BLANKS 1 \  
+    + 2
+int blanks = BLANKS;
+
+#if 0
+// skipped comment carried over \
+#endif
+int skipped;
+#endif
@@ -0,0 +1,8 @@
+/* Escapes are decoded and written back, adjacent literals stay apart */
+char *escapes = "tab\there \"quoted\" back\\slash \x41\101 nul\0end";
+char *joined = "first " "second";
+char chars[] = {'\n', '\x41', '\0', '\'', 'q'};
+
+#if '\x41' == 65 && '\n' == 10
+int ok;
+#endif
@@ -0,0 +1,20 @@
+#define A 1
+A;
+#undef A
+A;
+#define A 2
+#define A 3 + 3
+A;
+#if A == 6
+six;
+#endif
+#undef A
+#if defined(A)
+bad;
+#elif !defined A
+undefined;
+#endif
+#define A 9
+#if A == 9
+nine;
+#endif